@@ -0,0 +1,209 @@
+#ifndef AREALIGHT_H
+#define AREALIGHT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "structs.h"
+#include "packet.h"
+
+// Sampling of disc and rectangle lights. A texel takes between
+// AREA_LIGHT_MIN_SAMPLES and AREA_LIGHT_MAX_SAMPLES rays per area light,
+// more the wider the light looks from where it sits, so a soft shadow costs
+// a bounded number of rays however big the light. The sample points come
+// from fixed low-discrepancy patterns, turned (disc) or shifted (rectangle)
+// per texel so neighbouring texels don't band.
+#define AREA_LIGHT_MIN_SAMPLES 4
+// One bit per sample in a visibility mask
+#define AREA_LIGHT_MAX_SAMPLES 16
+
+// Unit patterns for every sample count. Disc points follow a Vogel spiral
+// inside the unit circle, rectangle points the R2 sequence in [0,1)^2.
+// Padded out to a whole number of SIMD vectors.
+struct AreaLightPatterns {
+    alignas(16) float discX[AREA_LIGHT_MAX_SAMPLES + 1][AREA_LIGHT_MAX_SAMPLES];
+    alignas(16) float discZ[AREA_LIGHT_MAX_SAMPLES + 1][AREA_LIGHT_MAX_SAMPLES];
+    alignas(16) float rectU[AREA_LIGHT_MAX_SAMPLES + 1][AREA_LIGHT_MAX_SAMPLES];
+    alignas(16) float rectV[AREA_LIGHT_MAX_SAMPLES + 1][AREA_LIGHT_MAX_SAMPLES];
+
+    AreaLightPatterns()
+    {
+        const double goldenAngle = 2.39996322972865332;
+        // 1/g and 1/g^2 for g the plastic number
+        const double r2X = 0.75487766624669276;
+        const double r2Z = 0.56984029099805327;
+        for (int n = 0; n <= AREA_LIGHT_MAX_SAMPLES; n++) {
+            for (int i = 0; i < AREA_LIGHT_MAX_SAMPLES; i++) {
+                bool used = i < n;
+                double r = used ? std::sqrt((i + 0.5) / n) : 0.0;
+                discX[n][i] = (float)(r * std::cos(i * goldenAngle));
+                discZ[n][i] = (float)(r * std::sin(i * goldenAngle));
+                double u = 0.5 + r2X * (i + 1), v = 0.5 + r2Z * (i + 1);
+                rectU[n][i] = used ? (float)(u - std::floor(u)) : 0.0f;
+                rectV[n][i] = used ? (float)(v - std::floor(v)) : 0.0f;
+            }
+        }
+    }
+};
+
+typedef struct AreaLightPatterns AreaLightPatterns;
+
+inline const AreaLightPatterns& GetAreaLightPatterns()
+{
+    static const AreaLightPatterns patterns;
+    return patterns;
+}
+
+inline bool IsAreaLight(const PointLight& l)
+{
+    return l.shape != LIGHT_POINT;
+}
+
+// Area lights sit in the middle of their pos cell, like a point light's
+// center ray aims
+inline float AreaLightCenterX(const PointLight& l) { return l.pos.x + 0.5f; }
+inline float AreaLightCenterZ(const PointLight& l) { return l.pos.z + 0.5f; }
+
+// Half extents of the box around the light's shape
+inline float AreaLightHalfX(const PointLight& l) { return l.sizeX; }
+inline float AreaLightHalfZ(const PointLight& l) { return l.shape == LIGHT_DISC ? l.sizeX : l.sizeZ; }
+
+// Angle the light covers as seen from (x, z) in the XZ plane, the 2D
+// stand-in for its solid angle. A full turn from inside the light.
+inline float AreaLightAngle(const PointLight& l, float x, float z)
+{
+    const float fullTurn = 6.28318531f;
+    float toX = AreaLightCenterX(l) - x, toZ = AreaLightCenterZ(l) - z;
+    float distance = std::sqrt(toX * toX + toZ * toZ);
+    if (l.shape == LIGHT_DISC) {
+        if (distance <= l.sizeX) { return fullTurn; }
+        return 2.0f * std::asin(l.sizeX / distance);
+    }
+    if (std::fabs(toX) <= l.sizeX && std::fabs(toZ) <= l.sizeZ) { return fullTurn; }
+    // Corners measured against the direction to the center. From outside a
+    // rectangle they all sit within half a turn of it.
+    float lo = 0.0f, hi = 0.0f;
+    for (int corner = 0; corner < 4; corner++) {
+        float cx = toX + (corner & 1 ? l.sizeX : -l.sizeX);
+        float cz = toZ + (corner & 2 ? l.sizeZ : -l.sizeZ);
+        float angle = std::atan2(toX * cz - toZ * cx, toX * cx + toZ * cz);
+        lo = std::min(lo, angle);
+        hi = std::max(hi, angle);
+    }
+    return hi - lo;
+}
+
+// Rays per area light for a texel at (x, z): one per spacing radians of
+// the angle it covers, within the sample bounds
+inline int AreaLightSampleCount(const PointLight& l, float x, float z, float spacing)
+{
+    float wanted = std::ceil(AreaLightAngle(l, x, z) / spacing);
+    if (!(wanted > AREA_LIGHT_MIN_SAMPLES)) { return AREA_LIGHT_MIN_SAMPLES; }
+    return wanted < AREA_LIGHT_MAX_SAMPLES ? (int)wanted : AREA_LIGHT_MAX_SAMPLES;
+}
+
+// Turn of a disc pattern, or shift of a rectangle pattern, from 32 random bits
+struct AreaLightFrame {
+    float centerX, centerZ;
+    float halfX, halfZ;
+    float cosTurn, sinTurn;
+    float shiftU, shiftV;
+};
+
+typedef struct AreaLightFrame AreaLightFrame;
+
+inline AreaLightFrame GetAreaLightFrame(const PointLight& l, uint32_t random)
+{
+    AreaLightFrame f;
+    f.centerX = AreaLightCenterX(l);
+    f.centerZ = AreaLightCenterZ(l);
+    f.halfX = AreaLightHalfX(l);
+    f.halfZ = AreaLightHalfZ(l);
+    float turn = (random >> 8) * (6.28318531f / 16777216.0f);
+    f.cosTurn = std::cos(turn);
+    f.sinTurn = std::sin(turn);
+    f.shiftU = (random & 0xffff) / 65536.0f;
+    f.shiftV = (random >> 16) / 65536.0f;
+    return f;
+}
+
+// Offsets from (x, z) to samples [first, count) of the light. Each sample is
+// worked out with the same float operations in the same order as the SIMD
+// path below, so the two agree bit for bit.
+inline void AreaLightOffsetsScalar(const PointLight& l, const AreaLightFrame& f, float x, float z,
+                                   int count, int first, float* dx, float* dz)
+{
+    const AreaLightPatterns& p = GetAreaLightPatterns();
+    for (int i = first; i < count; i++) {
+        if (l.shape == LIGHT_DISC) {
+            float px = p.discX[count][i], pz = p.discZ[count][i];
+            dx[i] = (f.centerX + f.halfX * (px * f.cosTurn - pz * f.sinTurn)) - x;
+            dz[i] = (f.centerZ + f.halfX * (px * f.sinTurn + pz * f.cosTurn)) - z;
+        } else {
+            float u = p.rectU[count][i] + f.shiftU;
+            float v = p.rectV[count][i] + f.shiftV;
+            u = u >= 1.0f ? u - 1.0f : u;
+            v = v >= 1.0f ? v - 1.0f : v;
+            dx[i] = (f.centerX + f.halfX * (u + u - 1.0f)) - x;
+            dz[i] = (f.centerZ + f.halfZ * (v + v - 1.0f)) - z;
+        }
+    }
+}
+
+#ifdef PACKET_X86
+
+// Four samples per round, returns how many it did
+__attribute__((target("sse2")))
+inline int AreaLightOffsetsSSE2(const PointLight& l, const AreaLightFrame& f, float x, float z,
+                                int count, float* dx, float* dz)
+{
+    const AreaLightPatterns& p = GetAreaLightPatterns();
+    const __m128 centerX = _mm_set1_ps(f.centerX), centerZ = _mm_set1_ps(f.centerZ);
+    const __m128 halfX = _mm_set1_ps(f.halfX), halfZ = _mm_set1_ps(f.halfZ);
+    const __m128 originX = _mm_set1_ps(x), originZ = _mm_set1_ps(z);
+    int i = 0;
+    if (l.shape == LIGHT_DISC) {
+        const __m128 cosTurn = _mm_set1_ps(f.cosTurn), sinTurn = _mm_set1_ps(f.sinTurn);
+        for (; i + 4 <= count; i += 4) {
+            __m128 px = _mm_load_ps(&p.discX[count][i]);
+            __m128 pz = _mm_load_ps(&p.discZ[count][i]);
+            __m128 rx = _mm_sub_ps(_mm_mul_ps(px, cosTurn), _mm_mul_ps(pz, sinTurn));
+            __m128 rz = _mm_add_ps(_mm_mul_ps(px, sinTurn), _mm_mul_ps(pz, cosTurn));
+            _mm_storeu_ps(dx + i, _mm_sub_ps(_mm_add_ps(centerX, _mm_mul_ps(halfX, rx)), originX));
+            _mm_storeu_ps(dz + i, _mm_sub_ps(_mm_add_ps(centerZ, _mm_mul_ps(halfX, rz)), originZ));
+        }
+        return i;
+    }
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 shiftU = _mm_set1_ps(f.shiftU), shiftV = _mm_set1_ps(f.shiftV);
+    for (; i + 4 <= count; i += 4) {
+        __m128 u = _mm_add_ps(_mm_load_ps(&p.rectU[count][i]), shiftU);
+        __m128 v = _mm_add_ps(_mm_load_ps(&p.rectV[count][i]), shiftV);
+        // Wrap back into [0,1)
+        u = _mm_sub_ps(u, _mm_and_ps(_mm_cmpge_ps(u, one), one));
+        v = _mm_sub_ps(v, _mm_and_ps(_mm_cmpge_ps(v, one), one));
+        __m128 su = _mm_sub_ps(_mm_add_ps(u, u), one);
+        __m128 sv = _mm_sub_ps(_mm_add_ps(v, v), one);
+        _mm_storeu_ps(dx + i, _mm_sub_ps(_mm_add_ps(centerX, _mm_mul_ps(halfX, su)), originX));
+        _mm_storeu_ps(dz + i, _mm_sub_ps(_mm_add_ps(centerZ, _mm_mul_ps(halfZ, sv)), originZ));
+    }
+    return i;
+}
+
+#endif
+
+// Offsets from (x, z) to all count samples of an area light
+inline void AreaLightOffsets(const PointLight& l, const AreaLightFrame& f, float x, float z,
+                             int count, float* dx, float* dz, SimdLevel level)
+{
+    int done = 0;
+#ifdef PACKET_X86
+    if (level >= SIMD_SSE2) {
+        done = AreaLightOffsetsSSE2(l, f, x, z, count, dx, dz);
+    }
+#endif
+    AreaLightOffsetsScalar(l, f, x, z, count, done, dx, dz);
+}
+
+#endif
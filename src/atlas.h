@@ -0,0 +1,97 @@
+#ifndef ATLAS_H
+#define ATLAS_H
+
+#include <algorithm>
+#include <vector>
+
+// Skyline rectangle packer with a fixed width and a height that grows as
+// rectangles are added. Each rectangle goes wherever its top edge ends up
+// lowest, ties broken by leftmost.
+class SkylinePacker
+{
+public:
+    int width = 0;
+    int height = 0;
+
+    explicit SkylinePacker(int atlasWidth = 0)
+    {
+        Reset(atlasWidth);
+    }
+
+    void Reset(int atlasWidth)
+    {
+        width = atlasWidth;
+        height = 0;
+        skyline.clear();
+        skyline.push_back(Segment{0, 0, atlasWidth});
+    }
+
+    // Places a w x h rectangle, returns false only if it is wider than the atlas
+    bool Insert(int w, int h, int& outX, int& outY)
+    {
+        int bestIndex = -1;
+        int bestY = 0;
+        for (int i = 0; i < (int)skyline.size(); i++) {
+            int y;
+            if (!fits(i, w, y)) { continue; }
+            if (bestIndex < 0 || y < bestY) {
+                bestIndex = i;
+                bestY = y;
+            }
+        }
+        if (bestIndex < 0) { return false; }
+
+        outX = skyline[bestIndex].x;
+        outY = bestY;
+        height = std::max(height, outY + h);
+
+        // Raise the skyline under the new rectangle
+        Segment placed{outX, outY + h, w};
+        skyline.insert(skyline.begin() + bestIndex, placed);
+        for (size_t i = bestIndex + 1; i < skyline.size(); ) {
+            Segment& s = skyline[i];
+            int overlap = placed.x + placed.width - s.x;
+            if (overlap <= 0) { break; }
+            if (overlap >= s.width) {
+                skyline.erase(skyline.begin() + i);
+                continue;
+            }
+            s.x += overlap;
+            s.width -= overlap;
+            break;
+        }
+        // Merge neighbours at the same height
+        for (size_t i = 0; i + 1 < skyline.size(); ) {
+            if (skyline[i].y == skyline[i+1].y) {
+                skyline[i].width += skyline[i+1].width;
+                skyline.erase(skyline.begin() + i + 1);
+            } else {
+                i++;
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Segment {
+        int x, y, width;
+    };
+
+    std::vector<Segment> skyline;
+
+    // Lowest y a rectangle of width w can sit at when its left edge is at
+    // segment i
+    bool fits(int i, int w, int& y) const
+    {
+        if (skyline[i].x + w > width) { return false; }
+        y = 0;
+        int remaining = w;
+        for (int j = i; remaining > 0; j++) {
+            y = std::max(y, skyline[j].y);
+            remaining -= skyline[j].width;
+        }
+        return true;
+    }
+};
+
+#endif
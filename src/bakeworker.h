@@ -0,0 +1,212 @@
+#ifndef BAKEWORKER_H
+#define BAKEWORKER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "lightmap.h"
+#include "spscqueue.h"
+
+// Where the charts sit in the atlas, as of some point in a bake
+struct LightMapLayout {
+    int atlasWidth, atlasHeight;
+    std::vector<LightMapChart> charts;
+};
+
+typedef struct LightMapLayout LightMapLayout;
+
+// Finished texels of one block of the atlas, rows packed, in the baker's
+// upload format. A block with layout set comes after the atlas was laid out
+// again: the texture wants allocating at the new size first, and the block
+// then covers all of it.
+struct BakedBlock {
+    AtlasRect rect;
+    std::vector<uint8_t> bytes;
+    std::shared_ptr<const LightMapLayout> layout;
+    // Set on the block that finished a bake, with the rays it took
+    bool bakeDone;
+    uint64_t raysTraced;
+};
+
+typedef struct BakedBlock BakedBlock;
+
+// Runs a LightMapBaker on a thread of its own (plus the baker's workers)
+// and streams out every block it finishes through a lock-free queue, so
+// the thread that owns GL only ever polls. Once Start is called the worker
+// owns the baker: other threads must leave it alone until Stop, and follow
+// the charts through the layouts that come with the blocks.
+class LightMapBakeWorker
+{
+public:
+    // How long the worker bakes between looks for an edited scene
+    double sliceMs = 4.0;
+    // Set to save a finished progressive bake there, as LoadFromCache expects
+    std::string cacheDir;
+
+    explicit LightMapBakeWorker(LightMapBaker& baker, size_t queueBlocks = 256)
+        : baker(baker), queue(queueBlocks) {}
+
+    ~LightMapBakeWorker()
+    {
+        Stop();
+    }
+
+    // Takes over the baker as it is, in the middle of a progressive bake or
+    // done with one
+    void Start()
+    {
+        if (thread.joinable()) { return; }
+        stopping = false;
+        sentLayout = currentLayout();
+        thread = std::thread([this]() { run(); });
+    }
+
+    // Waits for the slice being baked and hands the baker back. Blocks
+    // still queued stay there for TryPop.
+    void Stop()
+    {
+        if (!thread.joinable()) { return; }
+        {
+            std::lock_guard<std::mutex> lock(sceneMutex);
+            stopping = true;
+        }
+        sceneChanged.notify_all();
+        thread.join();
+    }
+
+    bool Running() const
+    {
+        return thread.joinable();
+    }
+
+    // Hands the worker an edited scene. It replaces any scene still waiting,
+    // and the worker picks it up at the end of its current slice.
+    void UpdateScene(const std::vector<Cube>& newCubes, const std::vector<PointLight>& newLights)
+    {
+        {
+            std::lock_guard<std::mutex> lock(sceneMutex);
+            pendingCubes = newCubes;
+            pendingLights = newLights;
+            scenePending = true;
+        }
+        sceneChanged.notify_all();
+    }
+
+    // Consumer side of the block queue, for one thread only
+    bool TryPop(BakedBlock& block)
+    {
+        return queue.TryPop(block);
+    }
+
+private:
+    void run()
+    {
+        for (;;) {
+            std::vector<Cube> newCubes;
+            std::vector<PointLight> newLights;
+            bool edited = false;
+            {
+                std::unique_lock<std::mutex> lock(sceneMutex);
+                // Nothing to bake: sleep until there is
+                sceneChanged.wait(lock, [this]() {
+                    return stopping || scenePending || baker.ProgressiveBaking();
+                });
+                if (stopping) { return; }
+                if (scenePending) {
+                    newCubes.swap(pendingCubes);
+                    newLights.swap(pendingLights);
+                    scenePending = false;
+                    edited = true;
+                }
+            }
+
+            if (edited) {
+                std::vector<RowSpan> rows = baker.UpdateScene(newCubes, newLights);
+                std::shared_ptr<const LightMapLayout> layout = currentLayout();
+                if (!sameLayout(*layout, *sentLayout)) {
+                    sentLayout = layout;
+                    push(AtlasRect{0, 0, layout->atlasWidth, layout->atlasHeight}, layout);
+                } else {
+                    for (auto& r : rows) {
+                        push(AtlasRect{0, r.first, baker.atlasWidth, r.count}, nullptr);
+                    }
+                }
+                continue;
+            }
+
+            std::vector<AtlasRect> rects = baker.StepProgressiveBake(sliceMs);
+            for (auto& r : rects) {
+                push(r, nullptr);
+            }
+            if (!baker.ProgressiveBaking()) {
+                if (!cacheDir.empty()) {
+                    baker.SaveToCache(cacheDir);
+                }
+                BakedBlock done{AtlasRect{0, 0, 0, 0}, {}, nullptr, true, baker.samplesTraced};
+                pushBlock(done);
+            }
+        }
+    }
+
+    // Copies a block out of the baker and queues it
+    void push(const AtlasRect& r, std::shared_ptr<const LightMapLayout> layout)
+    {
+        size_t rowBytes = (size_t)r.width * TexelFormatBytes(baker.format);
+        BakedBlock block{r, std::vector<uint8_t>(rowBytes * r.height), std::move(layout), false, 0};
+        for (int y = 0; y < r.height; y++) {
+            memcpy(block.bytes.data() + y * rowBytes, baker.UploadTexel(r.x, r.y + y), rowBytes);
+        }
+        pushBlock(block);
+    }
+
+    // A full queue means the consumer is behind; wait for it rather than
+    // drop blocks, unless told to stop
+    void pushBlock(BakedBlock& block)
+    {
+        while (!queue.TryPush(block)) {
+            if (stopping) { return; }
+            std::this_thread::yield();
+        }
+    }
+
+    std::shared_ptr<const LightMapLayout> currentLayout() const
+    {
+        return std::make_shared<const LightMapLayout>(LightMapLayout{baker.atlasWidth, baker.atlasHeight, baker.charts});
+    }
+
+    static bool sameLayout(const LightMapLayout& a, const LightMapLayout& b)
+    {
+        if (a.atlasWidth != b.atlasWidth || a.atlasHeight != b.atlasHeight || a.charts.size() != b.charts.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.charts.size(); i++) {
+            const LightMapChart& ca = a.charts[i];
+            const LightMapChart& cb = b.charts[i];
+            if (ca.x != cb.x || ca.y != cb.y || ca.width != cb.width || ca.height != cb.height) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    LightMapBaker& baker;
+    SpscQueue<BakedBlock> queue;
+    std::thread thread;
+    // Layout the consumer was last told about, only touched by the worker
+    std::shared_ptr<const LightMapLayout> sentLayout;
+
+    std::mutex sceneMutex;
+    std::condition_variable sceneChanged;
+    // Written under sceneMutex, read without it while the queue is full
+    std::atomic<bool> stopping{false};
+    bool scenePending = false;
+    std::vector<Cube> pendingCubes;
+    std::vector<PointLight> pendingLights;
+};
+
+#endif
@@ -0,0 +1,254 @@
+// Headless lightmap bake benchmark. Builds synthetic scenes, bakes each one
+// with LightMapBaker and prints the timings as JSON on stdout. Needs no
+// window, GL or GPU.
+//
+// Every scene option takes a comma separated list, and every combination
+// of them is benchmarked:
+//   --cubes N,...     random occluder cubes on the ground (64,256)
+//   --lights M,...    lights at random spots (1,8)
+//   --scale S,...     lightMapScale of every cube (16,64)
+//   --size W          side of the square ground, in cells (128)
+//   --falloff F       falloff of every light (0.02)
+//   --light-shape point|disc|rect, --light-size S   every light's shape and
+//                     radius or half extent (point, 2)
+//   --seed N          scene generator seed (1)
+//   --repeat R        bakes per scene, the fastest counts (3)
+//   -j N              bake threads, 0 for one per hardware thread (0)
+//   --mode dda|bvh|march|polar|sdf, --adaptive-aa, --simd scalar|sse2|avx2
+//   --polar-filter N  bins either side polar mode filters over (0)
+//   --sdf-soft K      soft shadows in sdf mode, K the softness (off)
+//   --light-cuts E    lightcuts over a light tree, E the error bound (off).
+//                     Turns adaptive AA off, and reports texelsAtCutCap
+//   --light-cut-size N  most clusters in a texel's cut (64), which wins
+//                     over the error bound
+//   --check-light-cuts  bakes every scene again without light cuts and
+//                     counts the texels off by more than the error bound;
+//                     exits with 2 if there are any
+//   --indirect N      radiosity bounces on top of the direct light (0)
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "../structs.h"
+#include "../lightmap.h"
+
+struct SceneParams {
+    int cubes;
+    int lights;
+    int scale;
+};
+
+typedef struct SceneParams SceneParams;
+
+// Small xorshift generator, so a seed gives the same scene everywhere
+struct SceneRandom {
+    uint32_t state;
+
+    int Next(int range)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return (int)(state % (uint32_t)range);
+    }
+};
+
+typedef struct SceneRandom SceneRandom;
+
+// A size x size ground lit from above, with occluders of 1 to 8 cells
+// across and 1 to 6 high dropped on it at random and lights scattered
+// between them at ground level
+void BuildScene(const SceneParams& p, int size, const PointLight& lightTemplate, uint32_t seed,
+                std::vector<Cube>& cubes, std::vector<PointLight>& lights)
+{
+    SceneRandom random{seed * 2654435761u + 1};
+    cubes.clear();
+    lights.clear();
+    cubes.push_back(Cube{Int3{0,0,size},Int3{size,0,0},"",false,false});
+    cubes.back().faces = FACE_TOP;
+    cubes.back().lightMapScale = p.scale;
+    for (int i = 0; i < p.cubes; i++) {
+        int width = 1 + random.Next(8);
+        int depth = 1 + random.Next(8);
+        int height = 1 + random.Next(6);
+        int x = random.Next(std::max(1, size - width));
+        int z = random.Next(std::max(1, size - depth));
+        cubes.push_back(Cube{Int3{x,0,z},Int3{x+width,height,z+depth},"",true,false});
+        cubes.back().lightMapScale = p.scale;
+    }
+    for (int i = 0; i < p.lights; i++) {
+        lights.push_back(lightTemplate);
+        lights.back().pos = Int3{random.Next(size),0,random.Next(size)};
+    }
+}
+
+std::vector<int> ParseList(const char* text)
+{
+    std::vector<int> values;
+    std::string s = text;
+    size_t start = 0;
+    while (start <= s.size()) {
+        size_t end = s.find(',', start);
+        if (end == std::string::npos) { end = s.size(); }
+        if (end > start) {
+            values.push_back(atoi(s.substr(start, end - start).c_str()));
+        }
+        start = end + 1;
+    }
+    return values;
+}
+
+int main(int argc, char *argv[])
+{
+    std::vector<int> cubeCounts = {64, 256};
+    std::vector<int> lightCounts = {1, 8};
+    std::vector<int> scales = {16, 64};
+    int size = 128;
+    PointLight lightTemplate{Int3{0,0,0}, 0.02f};
+    lightTemplate.sizeX = lightTemplate.sizeZ = 2.0f;
+    uint32_t seed = 1;
+    int repeat = 3;
+    bool checkLightCuts = false;
+    LightMapBaker baker;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--cubes" && hasValue) { cubeCounts = ParseList(argv[++i]); }
+        else if (arg == "--lights" && hasValue) { lightCounts = ParseList(argv[++i]); }
+        else if (arg == "--scale" && hasValue) { scales = ParseList(argv[++i]); }
+        else if (arg == "--size" && hasValue) { size = std::max(1, atoi(argv[++i])); }
+        else if (arg == "--falloff" && hasValue) { lightTemplate.falloff = (float)atof(argv[++i]); }
+        else if (arg == "--light-size" && hasValue) { lightTemplate.sizeX = lightTemplate.sizeZ = (float)atof(argv[++i]); }
+        else if (arg == "--light-shape" && hasValue) {
+            std::string name = argv[++i];
+            lightTemplate.shape = name == "disc" ? LIGHT_DISC : (name == "rect" ? LIGHT_RECT : LIGHT_POINT);
+        }
+        else if (arg == "--seed" && hasValue) { seed = (uint32_t)strtoul(argv[++i], NULL, 10); }
+        else if (arg == "--repeat" && hasValue) { repeat = std::max(1, atoi(argv[++i])); }
+        else if (arg == "-j" && hasValue) { baker.workers = (unsigned int)std::max(0, atoi(argv[++i])); }
+        else if (arg == "--adaptive-aa") { baker.adaptiveAA = true; }
+        else if (arg == "--polar-filter" && hasValue) { baker.polarFilter = std::max(0, atoi(argv[++i])); }
+        else if (arg == "--sdf-soft" && hasValue) {
+            baker.sdfSoftShadows = true;
+            baker.sdfSoftness = (float)atof(argv[++i]);
+        }
+        else if (arg == "--light-cuts" && hasValue) {
+            baker.lightCuts = true;
+            baker.lightCutError = (float)atof(argv[++i]);
+        }
+        else if (arg == "--light-cut-size" && hasValue) { baker.lightCutMaxSize = std::max(1, atoi(argv[++i])); }
+        else if (arg == "--check-light-cuts") { checkLightCuts = true; }
+        else if (arg == "--indirect" && hasValue) { baker.indirectBounces = std::max(0, atoi(argv[++i])); }
+        else if (arg == "--mode" && hasValue) {
+            std::string name = argv[++i];
+            if (name == "march") { baker.visibilityMode = VISIBILITY_MARCH; }
+            else if (name == "bvh") { baker.visibilityMode = VISIBILITY_BVH; }
+            else if (name == "polar") { baker.visibilityMode = VISIBILITY_POLAR; }
+            else if (name == "sdf") { baker.visibilityMode = VISIBILITY_SDF; }
+            else { baker.visibilityMode = VISIBILITY_DDA; }
+        }
+        else if (arg == "--simd" && hasValue) {
+            std::string name = argv[++i];
+            SimdLevel level = name == "scalar" ? SIMD_SCALAR : (name == "sse2" ? SIMD_SSE2 : SIMD_AVX2);
+            // Never above what the CPU can run
+            baker.simdLevel = std::min(level, DetectSimdLevel());
+        }
+        else {
+            fprintf(stderr, "Unknown or incomplete option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    const char* modeNames[] = {"march", "bvh", "dda", "polar", "sdf"};
+    const char* simdNames[] = {"scalar", "sse2", "avx2"};
+    const char* shapeNames[] = {"point", "disc", "rect"};
+    printf("{\n  \"settings\": {\"size\": %d, \"falloff\": %g, \"lightShape\": \"%s\", \"lightSize\": %g, "
+           "\"seed\": %u, \"repeat\": %d, "
+           "\"workers\": %u, \"mode\": \"%s\", \"simd\": \"%s\", \"adaptiveAA\": %s, \"polarFilter\": %d, \"sdfSoftness\": %g, "
+           "\"lightCutError\": %g, \"lightCutSize\": %d, \"indirectBounces\": %d},\n  \"results\": [",
+           size, lightTemplate.falloff, shapeNames[lightTemplate.shape], lightTemplate.sizeX,
+           seed, repeat, baker.workers, modeNames[baker.visibilityMode],
+           simdNames[baker.simdLevel], baker.AdaptiveAA() ? "true" : "false", baker.polarFilter,
+           baker.sdfSoftShadows ? baker.sdfSoftness : 0.0f,
+           baker.lightCuts ? baker.lightCutError : 0.0f, baker.lightCutMaxSize, baker.indirectBounces);
+
+    bool first = true;
+    int failed = 0;
+    std::vector<Cube> cubes;
+    std::vector<PointLight> lights;
+    for (int cubeCount : cubeCounts) {
+        for (int lightCount : lightCounts) {
+            for (int scale : scales) {
+                SceneParams p{cubeCount, lightCount, scale};
+                BuildScene(p, size, lightTemplate, seed, cubes, lights);
+
+                // PrepareScene builds the occupancy grid, BVH and maps, timed apart from the bake
+                auto setupStart = std::chrono::steady_clock::now();
+                baker.SetScene(cubes, lights);
+                baker.PrepareScene();
+                double setupSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - setupStart).count();
+
+                double bestSeconds = 0.0;
+                for (int r = 0; r < repeat; r++) {
+                    auto start = std::chrono::steady_clock::now();
+                    baker.Bake();
+                    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                    if (r == 0 || seconds < bestSeconds) { bestSeconds = seconds; }
+                }
+
+                size_t texels = baker.TexelCount();
+                uint64_t rays = baker.samplesTraced;
+
+                // The same scene baked exactly, compared texel by texel. Cuts
+                // take the full sample set, so the exact bake does too.
+                char check[192] = "";
+                if (baker.lightCuts) {
+                    snprintf(check, sizeof(check), "\"texelsAtCutCap\": %llu, ",
+                             (unsigned long long)baker.cutsCapped);
+                }
+                if (checkLightCuts && baker.lightCuts) {
+                    std::vector<float> cut = baker.data;
+                    bool adaptiveAA = baker.adaptiveAA;
+                    baker.lightCuts = false;
+                    baker.adaptiveAA = false;
+                    baker.Bake();
+                    baker.lightCuts = true;
+                    baker.adaptiveAA = adaptiveAA;
+                    size_t over = 0;
+                    float worst = 0.0f;
+                    for (size_t t = 0; t < cut.size(); t++) {
+                        float exact = baker.data[t];
+                        float off = std::fabs(cut[t] - exact);
+                        if (off > baker.lightCutError * exact + 1e-5f) { over++; }
+                        if (exact > 0.0f) { worst = std::max(worst, off / exact); }
+                    }
+                    failed += over > 0;
+                    size_t used = strlen(check);
+                    snprintf(check + used, sizeof(check) - used, "\"texelsOverError\": %zu, \"worstError\": %.6f, ",
+                             over, worst);
+                }
+                printf("%s\n    {\"cubes\": %d, \"lights\": %d, \"lightMapScale\": %d, "
+                       "\"atlasWidth\": %d, \"atlasHeight\": %d, \"texels\": %zu, \"rays\": %llu, "
+                       "\"patches\": %zu, \"links\": %zu, %s"
+                       "\"setupSeconds\": %.6f, \"wallSeconds\": %.6f, \"texelsPerSecond\": %.1f, \"raysPerSecond\": %.1f}",
+                       first ? "" : ",", cubeCount, lightCount, scale,
+                       baker.atlasWidth, baker.atlasHeight, texels, (unsigned long long)rays,
+                       baker.radiosity.PatchCount(), baker.radiosity.LinkCount(), check,
+                       setupSeconds, bestSeconds,
+                       bestSeconds > 0.0 ? texels / bestSeconds : 0.0,
+                       bestSeconds > 0.0 ? rays / bestSeconds : 0.0);
+                fflush(stdout);
+                first = false;
+            }
+        }
+    }
+    printf("\n  ]\n}\n");
+    return failed > 0 ? 2 : 0;
+}
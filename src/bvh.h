@@ -0,0 +1,151 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "structs.h"
+
+// Bounding volume hierarchy over the occluder cubes, used to answer
+// "does this segment hit anything" with one query instead of marching.
+// A cube covers the cells from its min corner to its max corner inclusive,
+// so as a solid box it spans [min, max+1] on every axis.
+class CubeBVH
+{
+public:
+    struct Box {
+        Float3 lo, hi;
+    };
+
+    struct Node {
+        Box bounds;
+        // Leaf: first box and count. Inner node: count is 0, left child is
+        // the next node and right child is at index first.
+        int first = 0;
+        int count = 0;
+    };
+
+    std::vector<Node> nodes;
+    std::vector<Box> boxes;
+
+    void Build(const std::vector<Cube>& cubes)
+    {
+        nodes.clear();
+        boxes.clear();
+        for (auto& c : cubes) {
+            if (!c.occluder) { continue; }
+            Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+            Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+            boxes.push_back(Box{
+                Float3{(float)minCorner.x, (float)minCorner.y, (float)minCorner.z},
+                Float3{(float)maxCorner.x+1.0f, (float)maxCorner.y+1.0f, (float)maxCorner.z+1.0f}
+            });
+        }
+        if (boxes.empty()) { return; }
+        nodes.reserve(boxes.size() * 2);
+        buildNode(0, (int)boxes.size());
+    }
+
+    // True if the segment origin + t*dir, t in [0, tMax), touches any box
+    bool AnyHit(Float3 origin, Float3 dir, float tMax = 1.0f) const
+    {
+        if (nodes.empty()) { return false; }
+        Float3 invDir{1.0f/dir.x, 1.0f/dir.y, 1.0f/dir.z};
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            const Node& n = nodes[stack[--top]];
+            if (!intersects(n.bounds, origin, dir, invDir, tMax)) { continue; }
+            if (n.count > 0) {
+                for (int i = n.first; i < n.first + n.count; i++) {
+                    if (intersects(boxes[i], origin, dir, invDir, tMax)) {
+                        return true;
+                    }
+                }
+            } else {
+                int self = (int)(&n - nodes.data());
+                stack[top++] = n.first;
+                stack[top++] = self + 1;
+            }
+        }
+        return false;
+    }
+
+private:
+    static const int maxLeafSize = 4;
+
+    static float axis(const Float3& v, int a)
+    {
+        return a == 0 ? v.x : (a == 1 ? v.y : v.z);
+    }
+
+    static Box merge(const Box& a, const Box& b)
+    {
+        return Box{
+            Float3{std::min(a.lo.x,b.lo.x), std::min(a.lo.y,b.lo.y), std::min(a.lo.z,b.lo.z)},
+            Float3{std::max(a.hi.x,b.hi.x), std::max(a.hi.y,b.hi.y), std::max(a.hi.z,b.hi.z)}
+        };
+    }
+
+    int buildNode(int first, int count)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(Node{});
+
+        Box bounds = boxes[first];
+        for (int i = first + 1; i < first + count; i++) {
+            bounds = merge(bounds, boxes[i]);
+        }
+        nodes[index].bounds = bounds;
+
+        if (count <= maxLeafSize) {
+            nodes[index].first = first;
+            nodes[index].count = count;
+            return index;
+        }
+
+        // Median split along the longest axis of the box centers
+        Float3 extent{bounds.hi.x-bounds.lo.x, bounds.hi.y-bounds.lo.y, bounds.hi.z-bounds.lo.z};
+        int a = 0;
+        if (extent.y > axis(extent, a)) { a = 1; }
+        if (extent.z > axis(extent, a)) { a = 2; }
+        int mid = first + count / 2;
+        std::nth_element(boxes.begin() + first, boxes.begin() + mid, boxes.begin() + first + count,
+            [a](const Box& l, const Box& r) {
+                return axis(l.lo, a) + axis(l.hi, a) < axis(r.lo, a) + axis(r.hi, a);
+            });
+
+        buildNode(first, mid - first);
+        int right = buildNode(mid, first + count - mid);
+        nodes[index].first = right;
+        nodes[index].count = 0;
+        return index;
+    }
+
+    // Slab test, clipped to [0, tMax)
+    static bool intersects(const Box& b, const Float3& o, const Float3& d, const Float3& invDir, float tMax)
+    {
+        float tEnter = 0.0f;
+        float tExit = tMax;
+        for (int a = 0; a < 3; a++) {
+            float oa = axis(o, a);
+            if (axis(d, a) == 0.0f) {
+                // Parallel to this slab, so it's either always inside or never
+                if (oa < axis(b.lo, a) || oa >= axis(b.hi, a)) { return false; }
+                continue;
+            }
+            float t0 = (axis(b.lo, a) - oa) * axis(invDir, a);
+            float t1 = (axis(b.hi, a) - oa) * axis(invDir, a);
+            if (t0 > t1) { std::swap(t0, t1); }
+            tEnter = std::max(tEnter, t0);
+            tExit = std::min(tExit, t1);
+            if (tEnter > tExit) { return false; }
+        }
+        return tEnter < tMax;
+    }
+};
+
+#endif
@@ -1 +1,14 @@
-#define TOTAL_LIGHTMAP_SIZE 1024
\ No newline at end of file
+// Texels of padding around each chart in the lightmap atlas
+#define LIGHTMAP_CHART_PADDING 1
+// Texels per side of one lightmap bake work item
+#define BAKE_TILE_SIZE 16
+// Pixel buffer objects the lightmap uploads rotate through
+#define LIGHTMAP_UPLOAD_BUFFERS 4
+// Bytes of baked lightmap uploaded per frame at most, past the first block
+#define LIGHTMAP_UPLOAD_BUDGET (4 << 20)
+// Most samples a texel takes of one light, one bit each in a visibility mask
+#define LIGHTMAP_MAX_SAMPLES 16
+// Vertices and indices a level mesh build holds at most before handing
+// them on, per index stream
+#define LEVEL_MESH_BATCH_VERTICES 16384
+#define LEVEL_MESH_BATCH_INDICES 24576
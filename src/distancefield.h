@@ -0,0 +1,248 @@
+#ifndef DISTANCEFIELD_H
+#define DISTANCEFIELD_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "occupancy.h"
+#include "traversal.h"
+
+// Gap between the centers of two cells no point of one can be closer than
+// to any point of the other: two half diagonals, rounded up
+#define DISTANCE_FIELD_CELL_SLACK 1.4143f
+
+// Distance between the segment origin + t*(dx,dz), t in [0,1], and the box
+// [loX, hiX] x [loZ, hiZ]; 0 when they touch
+inline float SegmentBoxDistance2D(float originX, float originZ, float dx, float dz,
+                                  float loX, float loZ, float hiX, float hiZ)
+{
+    // Clip the segment against the box's slabs first
+    float t0 = 0.0f, t1 = 1.0f;
+    float start[2] = {originX, originZ}, step[2] = {dx, dz};
+    float lo[2] = {loX, loZ}, hi[2] = {hiX, hiZ};
+    bool touches = true;
+    for (int axis = 0; axis < 2 && touches; axis++) {
+        if (step[axis] == 0.0f) {
+            touches = start[axis] >= lo[axis] && start[axis] <= hi[axis];
+            continue;
+        }
+        float a = (lo[axis] - start[axis]) / step[axis];
+        float b = (hi[axis] - start[axis]) / step[axis];
+        t0 = std::max(t0, std::min(a, b));
+        t1 = std::min(t1, std::max(a, b));
+        touches = t0 <= t1;
+    }
+    if (touches) { return 0.0f; }
+
+    // Otherwise the closest pair has an end of the segment or a corner of
+    // the box in it
+    auto pointToBox = [&](float x, float z) {
+        float outX = std::max(std::max(loX - x, x - hiX), 0.0f);
+        float outZ = std::max(std::max(loZ - z, z - hiZ), 0.0f);
+        return std::sqrt(outX * outX + outZ * outZ);
+    };
+    auto pointToSegment = [&](float x, float z) {
+        float length2 = dx * dx + dz * dz;
+        float t = length2 > 0.0f ? ((x - originX) * dx + (z - originZ) * dz) / length2 : 0.0f;
+        t = std::min(std::max(t, 0.0f), 1.0f);
+        float offX = originX + dx * t - x, offZ = originZ + dz * t - z;
+        return std::sqrt(offX * offX + offZ * offZ);
+    };
+    float nearest = std::min(pointToBox(originX, originZ), pointToBox(originX + dx, originZ + dz));
+    nearest = std::min(nearest, std::min(pointToSegment(loX, loZ), pointToSegment(hiX, loZ)));
+    nearest = std::min(nearest, std::min(pointToSegment(loX, hiZ), pointToSegment(hiX, hiZ)));
+    return nearest;
+}
+
+// Signed distance from every cell center of each grid layer to the center
+// of the nearest cell of the other kind: positive out in the open, negative
+// inside an occluder. Built from the occupancy grid with an exact Euclidean
+// distance transform (Felzenszwalb and Huttenlocher), linear in the cells,
+// one pass along the rows and one along the columns.
+class DistanceField2D
+{
+public:
+    // Cells of the occupancy grid, plus one empty cell all round so the
+    // inside distance always finds open space
+    Int3 origin{0,0,0};
+    int width = 0;
+    int depth = 0;
+    int layers = 0;
+    std::vector<float> distance;
+
+    // parallel(count, task) runs task(0) to task(count - 1), in any order
+    // and on any threads
+    void Build(const OccupancyGrid& grid, const std::function<void(int, const std::function<void(int)>&)>& parallel)
+    {
+        origin = Int3{grid.origin.x - 1, grid.origin.y, grid.origin.z - 1};
+        width = grid.size.x + 2;
+        depth = grid.size.z + 2;
+        layers = grid.size.y;
+        if (grid.bits.empty()) {
+            Clear();
+            return;
+        }
+        // Squared distances to solid and to open cells, rows then columns
+        std::vector<float> outside((size_t)width * depth * layers);
+        std::vector<float> inside(outside.size());
+        parallel(depth * layers, [&](int row) {
+            int y = row / depth, z = row % depth;
+            std::vector<float> solid(width), open(width);
+            for (int x = 0; x < width; x++) {
+                bool occupied = grid.IsOccupied(Int3{origin.x + x, origin.y + y, origin.z + z});
+                solid[x] = occupied ? 0.0f : far();
+                open[x] = occupied ? far() : 0.0f;
+            }
+            size_t first = (size_t)row * width;
+            transform(solid.data(), width, 1, &outside[first], 1);
+            transform(open.data(), width, 1, &inside[first], 1);
+        });
+        distance.assign(outside.size(), 0.0f);
+        parallel(width * layers, [&](int column) {
+            int y = column / width, x = column % width;
+            size_t first = (size_t)y * width * depth + x;
+            std::vector<float> out(depth), in(depth);
+            transform(&outside[first], depth, width, out.data(), 1);
+            transform(&inside[first], depth, width, in.data(), 1);
+            for (int z = 0; z < depth; z++) {
+                distance[first + (size_t)z * width] = out[z] > 0.0f ? std::sqrt(out[z]) : -std::sqrt(in[z]);
+            }
+        });
+    }
+
+    void Clear()
+    {
+        width = depth = layers = 0;
+        distance.clear();
+    }
+
+    // Signed distance at a cell's center. Beyond the grid, a lower bound
+    // taken from its edge.
+    float At(int x, int layer, int z) const
+    {
+        int gx = x - origin.x, gy = layer - origin.y, gz = z - origin.z;
+        if ((unsigned)gy >= (unsigned)layers) { return far(); }
+        if ((unsigned)gx < (unsigned)width && (unsigned)gz < (unsigned)depth) {
+            return distance[((size_t)gy * depth + gz) * width + gx];
+        }
+        // The outermost ring is always open, so nothing solid is closer
+        // than the grid's inner edge
+        float outX = (float)std::max(std::max(1 - gx, gx - (width - 2)), 0);
+        float outZ = (float)std::max(std::max(1 - gz, gz - (depth - 2)), 0);
+        return std::sqrt(outX * outX + outZ * outZ);
+    }
+
+    // Is anything solid on the half-open segment origin + t*(dx,dz), t in
+    // [0,1), in the layer. Visits the same cells as TraverseCells2D, except
+    // that wherever the field says nothing solid is within reach it jumps
+    // ahead that far instead of walking cell by cell. With penumbra set, it
+    // also gets an estimate of how lit the end is, in [0, 1]: the least
+    // softness * clearance / distance travelled over the cells visited. That
+    // takes every cell's clearance, so it walks all of them.
+    bool Trace(const OccupancyGrid& grid, int layer, float originX, float originZ, float dx, float dz,
+               float softness = 0.0f, float* penumbra = nullptr) const
+    {
+        if (penumbra) { *penumbra = 1.0f; }
+        if ((unsigned)(layer - origin.y) >= (unsigned)layers) { return false; }
+        const float length = std::sqrt(dx * dx + dz * dz);
+        if (length == 0.0f) { return false; }
+
+        CellWalk2D w = BeginCellWalk2D(originX, originZ, dx, dz);
+        const int lastX = w.cellX + w.stepX * w.remainingX;
+        const int lastZ = w.cellY + w.stepY * w.remainingY;
+        // t at which the walk came into the current cell
+        float enter = 0.0f;
+        for (;;) {
+            if (grid.IsOccupied(Int3{w.cellX, layer, w.cellY})) {
+                if (penumbra) { *penumbra = 0.0f; }
+                return true;
+            }
+            if (w.remainingX + w.remainingY == 0) {
+                return false;
+            }
+            float center = At(w.cellX, layer, w.cellY);
+            float along = enter * length;
+            if (penumbra && along > 0.5f) {
+                float lit = softness * std::max(0.0f, center - 0.5f) / along;
+                *penumbra = std::min(*penumbra, lit);
+            }
+            // Nothing solid within clear of any point of this cell, so the
+            // walk can pick up again that much further on
+            float clear = center - DISTANCE_FIELD_CELL_SLACK;
+            if (clear >= 1.0f && !penumbra) {
+                enter += clear / length;
+                if (enter >= 1.0f) {
+                    return false;
+                }
+                jump(w, originX, originZ, dx, dz, enter, lastX, lastZ);
+                continue;
+            }
+            bool alongX = w.remainingY == 0 || (w.remainingX > 0 && w.tMaxX < w.tMaxY);
+            enter = alongX ? w.tMaxX : w.tMaxY;
+            StepCellWalk2D(w);
+        }
+    }
+
+private:
+    // Moves a walk on to the cell at t along its segment, keeping its end
+    static void jump(CellWalk2D& w, float originX, float originZ, float dx, float dz, float t, int lastX, int lastZ)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        int cellX = (int)std::floor(originX + dx * t);
+        int cellZ = (int)std::floor(originZ + dz * t);
+        // Rounding can't be allowed to carry it past the last cell
+        if ((lastX - cellX) * w.stepX < 0) { cellX = lastX; }
+        if ((lastZ - cellZ) * w.stepY < 0) { cellZ = lastZ; }
+        w.cellX = cellX;
+        w.cellY = cellZ;
+        w.tMaxX = w.stepX > 0 ? (cellX + 1 - originX) / dx : (w.stepX < 0 ? (cellX - originX) / dx : inf);
+        w.tMaxY = w.stepY > 0 ? (cellZ + 1 - originZ) / dz : (w.stepY < 0 ? (cellZ - originZ) / dz : inf);
+        w.remainingX = std::abs(lastX - cellX);
+        w.remainingY = std::abs(lastZ - cellZ);
+    }
+
+    static float far()
+    {
+        return 1e20f;
+    }
+
+    // 1D squared distance transform of the n samples f[i * stride] into
+    // d[i * outStride]: the least (i - j)^2 + f[j] over every j, from the
+    // lower envelope of the parabolas rooted at each sample
+    static void transform(const float* f, int n, int stride, float* d, int outStride)
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        std::vector<int> roots(n);
+        std::vector<float> bounds(n + 1);
+        // Where the parabolas rooted at q and r cross
+        auto cross = [&](int q, int r) {
+            return ((f[q * stride] + (float)q * q) - (f[r * stride] + (float)r * r)) / (2.0f * (q - r));
+        };
+        int k = 0;
+        roots[0] = 0;
+        bounds[0] = -inf;
+        bounds[1] = inf;
+        for (int q = 1; q < n; q++) {
+            float s = cross(q, roots[k]);
+            while (s <= bounds[k]) {
+                k--;
+                s = cross(q, roots[k]);
+            }
+            k++;
+            roots[k] = q;
+            bounds[k] = s;
+            bounds[k + 1] = inf;
+        }
+        k = 0;
+        for (int q = 0; q < n; q++) {
+            while (bounds[k + 1] < q) { k++; }
+            float offset = (float)(q - roots[k]);
+            d[q * outStride] = offset * offset + f[roots[k] * stride];
+        }
+    }
+};
+
+#endif
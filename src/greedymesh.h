@@ -0,0 +1,347 @@
+#ifndef GREEDYMESH_H
+#define GREEDYMESH_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "structs.h"
+#include "mesh.h"
+
+// Which emissive face parts may share quads: parts on the same plane facing
+// the same way with the same texture, that lay their texture coordinates
+// the same way but for whole repeats. The merged quad carries one face's
+// coordinates on past 1 instead, which GL_REPEAT draws the same as long as
+// the texture scale is a whole number.
+struct GreedyMaterial {
+    std::string texture;
+    float scaleHorizontal, scaleVertical;
+    // Face of cubeVertices the triangles are wound like, and the side it faces
+    int face, sign;
+    // s runs along uAxis and reaches 1 after uLength (negative if it runs
+    // the other way); uPhase is where it starts over, modulo the length.
+    // t likewise along vAxis.
+    int uAxis, uLength, uPhase;
+    int vAxis, vLength, vPhase;
+
+    bool operator<(const GreedyMaterial& o) const
+    {
+        return std::tie(texture, scaleHorizontal, scaleVertical, face, sign, uAxis, uLength, uPhase, vAxis, vLength, vPhase) <
+               std::tie(o.texture, o.scaleHorizontal, o.scaleVertical, o.face, o.sign, o.uAxis, o.uLength, o.uPhase, o.vAxis, o.vLength, o.vPhase);
+    }
+};
+
+typedef struct GreedyMaterial GreedyMaterial;
+
+// Merges the given disjoint rectangles into fewer, larger ones covering
+// the same area: rectangles that touch are grouped, each group laid on a
+// grid of the distinct coordinates of its edges, and the grid covered row
+// by row with the widest, then tallest, rectangle at each open cell.
+inline void GreedyMerge(const std::vector<FaceRect>& rects, std::vector<FaceRect>& merged)
+{
+    merged.clear();
+    int n = (int)rects.size();
+    std::vector<int> parent(n);
+    for (int i = 0; i < n; i++) { parent[i] = i; }
+    auto find = [&](int i) {
+        while (parent[i] != i) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    };
+    // Rectangles that share a stretch of edge, along each axis in turn: on
+    // each line, the ones ending there against the ones starting there,
+    // both sorted along the line
+    for (int k = 0; k < 2; k++) {
+        std::map<float, std::pair<std::vector<int>, std::vector<int>>> lines;
+        for (int i = 0; i < n; i++) {
+            lines[rects[i].hi[k]].first.push_back(i);
+            lines[rects[i].lo[k]].second.push_back(i);
+        }
+        auto along = [&](int a, int b) { return rects[a].lo[1 - k] < rects[b].lo[1 - k]; };
+        for (auto& line : lines) {
+            std::vector<int>& ending = line.second.first;
+            std::vector<int>& starting = line.second.second;
+            std::sort(ending.begin(), ending.end(), along);
+            std::sort(starting.begin(), starting.end(), along);
+            size_t e = 0, s = 0;
+            while (e < ending.size() && s < starting.size()) {
+                const FaceRect& re = rects[ending[e]];
+                const FaceRect& rs = rects[starting[s]];
+                if (std::min(re.hi[1 - k], rs.hi[1 - k]) > std::max(re.lo[1 - k], rs.lo[1 - k])) {
+                    parent[find(ending[e])] = find(starting[s]);
+                }
+                if (re.hi[1 - k] < rs.hi[1 - k]) { e++; } else { s++; }
+            }
+        }
+    }
+
+    std::map<int, std::vector<int>> groups;
+    for (int i = 0; i < n; i++) {
+        groups[find(i)].push_back(i);
+    }
+    std::vector<float> xs, ys;
+    std::vector<uint8_t> open;
+    for (auto& g : groups) {
+        xs.clear();
+        ys.clear();
+        for (int i : g.second) {
+            xs.push_back(rects[i].lo[0]);
+            xs.push_back(rects[i].hi[0]);
+            ys.push_back(rects[i].lo[1]);
+            ys.push_back(rects[i].hi[1]);
+        }
+        std::sort(xs.begin(), xs.end());
+        xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+        std::sort(ys.begin(), ys.end());
+        ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+        int width = (int)xs.size() - 1, height = (int)ys.size() - 1;
+        open.assign((size_t)width * height, 0);
+        for (int i : g.second) {
+            int x0 = (int)(std::lower_bound(xs.begin(), xs.end(), rects[i].lo[0]) - xs.begin());
+            int x1 = (int)(std::lower_bound(xs.begin(), xs.end(), rects[i].hi[0]) - xs.begin());
+            int y0 = (int)(std::lower_bound(ys.begin(), ys.end(), rects[i].lo[1]) - ys.begin());
+            int y1 = (int)(std::lower_bound(ys.begin(), ys.end(), rects[i].hi[1]) - ys.begin());
+            for (int y = y0; y < y1; y++) {
+                std::fill(open.begin() + (size_t)y * width + x0, open.begin() + (size_t)y * width + x1, 1);
+            }
+        }
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                if (!open[(size_t)y * width + x]) { continue; }
+                int x1 = x + 1;
+                while (x1 < width && open[(size_t)y * width + x1]) { x1++; }
+                int y1 = y + 1;
+                while (y1 < height && std::all_of(open.begin() + (size_t)y1 * width + x,
+                                                  open.begin() + (size_t)y1 * width + x1, [](uint8_t o) { return o != 0; })) {
+                    y1++;
+                }
+                for (int row = y; row < y1; row++) {
+                    std::fill(open.begin() + (size_t)row * width + x, open.begin() + (size_t)row * width + x1, 0);
+                }
+                merged.push_back(FaceRect{{xs[x], ys[y]}, {xs[x1], ys[y1]}});
+            }
+        }
+    }
+}
+
+// Calls corner(v) for the six corners (x, y, z, s, t) of the two triangles
+// of the quad r on the given plane, in the order, and so with the winding,
+// of the material's template face
+template <typename Corner>
+void GreedyQuadCorners(const GreedyMaterial& m, float plane, const FaceRect& r, Corner corner)
+{
+    const int axis = m.face < 2 ? 2 : (m.face < 4 ? 0 : 1);
+    const int a = axis == 0 ? 1 : 0;
+    const int b = axis == 2 ? 1 : 2;
+    // Texture coordinates at the two ends of the quad along the axes s and
+    // t run along
+    float lo[3], hi[3];
+    lo[a] = r.lo[0]; hi[a] = r.hi[0];
+    lo[b] = r.lo[1]; hi[b] = r.hi[1];
+    float s0 = (lo[m.uAxis] - m.uPhase) / m.uLength, s1 = (hi[m.uAxis] - m.uPhase) / m.uLength;
+    float t0 = (lo[m.vAxis] - m.vPhase) / m.vLength, t1 = (hi[m.vAxis] - m.vPhase) / m.vLength;
+    for (int k = 0; k < 6; k++) {
+        const float* templateCorner = cubeVertices + (m.face * 6 + k) * 5;
+        float s = templateCorner[3] > 0.5f ? std::max(s0, s1) : std::min(s0, s1);
+        float t = templateCorner[4] > 0.5f ? std::max(t0, t1) : std::min(t0, t1);
+        std::array<float, 5> v;
+        v[axis] = plane;
+        v[m.uAxis] = m.uPhase + s * m.uLength;
+        v[m.vAxis] = m.vPhase + t * m.vLength;
+        v[3] = s;
+        v[4] = t;
+        corner(v);
+    }
+}
+
+// Streams the same mesh as StreamLevelMesh, except where emissive faces
+// can do with fewer quads: what's left of each of them once the parts
+// other cubes cover are cut away is merged with the parts next to it on the
+// same plane into maximal quads, as far as GreedyMaterial allows. A group
+// of parts is only drawn merged if that takes fewer quads than the faces
+// it came from, and no more corners than those faces have to themselves
+// once they share with the rest of their cubes; otherwise it's drawn as
+// the faces. Faces that sample the lightmap are always drawn whole:
+// each is a chart of its own, so its parts could never come to fewer than
+// the one quad the whole face is. Quads of one group share corners; groups
+// don't. Holds the merged quads, a few words each, while it counts the
+// mesh and then streams it.
+inline void StreamGreedyLevelMesh(const std::vector<Cube>& cubes, LevelMesh& mesh, const LevelMeshOutput& out)
+{
+    std::map<GreedyMaterial, int> materialIds;
+    std::vector<GreedyMaterial> materials;
+    // Uncovered parts of the emissive faces, and the faces they're from,
+    // by material and the plane they're on
+    struct Group {
+        std::vector<FaceRect> parts;
+        std::vector<int> faces;
+        size_t vertexCount;
+    };
+    std::map<std::pair<int, float>, Group> groups;
+    // FACE_* flags of the faces that show at all, and of those drawn whole
+    std::vector<uint8_t> exposed(cubes.size(), 0);
+    std::vector<uint8_t> whole(cubes.size(), 0);
+    std::vector<FaceRect> open;
+    ForEachFaceNeighbours(cubes, [&](int i, int f, const std::vector<int>& others) {
+        FaceUncovered(cubes, i, f, others, open);
+        if (open.empty()) { return; }
+        exposed[i] |= cubeFaceFlags[f];
+        const Cube& c = cubes[i];
+        if (!c.emissive) {
+            whole[i] |= cubeFaceFlags[f];
+            return;
+        }
+        CubeFace face = GetCubeFace(c, f);
+        GreedyMaterial m;
+        m.texture = c.textureName;
+        m.scaleHorizontal = c.textureScaleHorizontal;
+        m.scaleVertical = c.textureScaleVertical;
+        m.face = f;
+        m.sign = face.sign;
+        int* mapped[2][3] = {{&m.uAxis, &m.uLength, &m.uPhase}, {&m.vAxis, &m.vLength, &m.vPhase}};
+        for (int k = 0; k < 2; k++) {
+            const float* along = k == 0 ? face.u : face.v;
+            int axis = 0;
+            for (int a = 1; a < 3; a++) {
+                if (std::fabs(along[a]) > std::fabs(along[axis])) { axis = a; }
+            }
+            int length = (int)std::lround(along[axis]);
+            int origin = (int)std::lround(face.origin[axis]);
+            *mapped[k][0] = axis;
+            *mapped[k][1] = length;
+            *mapped[k][2] = ((origin % std::abs(length)) + std::abs(length)) % std::abs(length);
+        }
+        auto found = materialIds.find(m);
+        int id;
+        if (found == materialIds.end()) {
+            id = (int)materials.size();
+            materialIds[m] = id;
+            materials.push_back(m);
+            // Where s and t are 0 for the whole material: this face's origin
+            materials.back().uPhase = (int)std::lround(face.origin[m.uAxis]);
+            materials.back().vPhase = (int)std::lround(face.origin[m.vAxis]);
+        } else {
+            id = found->second;
+        }
+        Group& g = groups[std::make_pair(id, face.plane)];
+        g.parts.insert(g.parts.end(), open.begin(), open.end());
+        g.faces.push_back(i * CUBE_FACE_COUNT + f);
+    });
+    // A group's material, with texture coordinates starting over where the
+    // group starts rather than at the face the material was first seen on.
+    // That's whole repeats away, so nothing shows, and it keeps them small
+    // enough to pack.
+    auto groupMaterial = [&](const std::pair<const std::pair<int, float>, Group>& g) {
+        GreedyMaterial m = materials[g.first.first];
+        const std::vector<FaceRect>& parts = g.second.parts;
+        const int axis = m.face < 2 ? 2 : (m.face < 4 ? 0 : 1);
+        const int a = axis == 0 ? 1 : 0;
+        const int b = axis == 2 ? 1 : 2;
+        float lowest[3] = {0.0f, 0.0f, 0.0f};
+        lowest[a] = parts[0].lo[0];
+        lowest[b] = parts[0].lo[1];
+        for (const FaceRect& r : parts) {
+            lowest[a] = std::min(lowest[a], r.lo[0]);
+            lowest[b] = std::min(lowest[b], r.lo[1]);
+        }
+        int* phases[2] = {&m.uPhase, &m.vPhase};
+        const int axes[2] = {m.uAxis, m.vAxis};
+        const int lengths[2] = {std::abs(m.uLength), std::abs(m.vLength)};
+        for (int k = 0; k < 2; k++) {
+            int start = (int)std::lround(lowest[axes[k]]);
+            *phases[k] += (int)std::floor((double)(start - *phases[k]) / lengths[k]) * lengths[k];
+        }
+        return m;
+    };
+
+    // Corners of a face no other face of its cube that shows has
+    const CubeIndexTemplate& t = GetCubeIndexTemplate();
+    auto ownCorners = [&](int face) {
+        int i = face / CUBE_FACE_COUNT, f = face % CUBE_FACE_COUNT;
+        bool shared[36] = {};
+        for (int other = 0; other < CUBE_FACE_COUNT; other++) {
+            if (other == f || !(exposed[i] & cubeFaceFlags[other])) { continue; }
+            for (int k = other * 6; k < other * 6 + 6; k++) {
+                shared[t.indices[k]] = true;
+            }
+        }
+        bool own[36] = {};
+        for (int k = f * 6; k < f * 6 + 6; k++) {
+            own[t.indices[k]] = !shared[t.indices[k]];
+        }
+        return (size_t)std::count(own, own + 36, true);
+    };
+    // Each group merged in place, dropping the parts as it goes, or handed
+    // back to the faces it came from
+    std::vector<FaceRect> merged;
+    std::map<std::array<float, 5>, uint32_t> placed;
+    for (auto g = groups.begin(); g != groups.end();) {
+        Group& group = g->second;
+        GreedyMerge(group.parts, merged);
+        group.parts.assign(merged.begin(), merged.end());
+        group.parts.shrink_to_fit();
+        const GreedyMaterial m = groupMaterial(*g);
+        placed.clear();
+        for (const FaceRect& r : group.parts) {
+            GreedyQuadCorners(m, g->first.second, r, [&](const std::array<float, 5>& v) { placed[v] = 0; });
+        }
+        group.vertexCount = placed.size();
+        size_t faceCorners = 0;
+        for (int face : group.faces) {
+            faceCorners += ownCorners(face);
+        }
+        if (group.parts.size() >= group.faces.size() || group.vertexCount > faceCorners) {
+            for (int face : group.faces) {
+                whole[face / CUBE_FACE_COUNT] |= cubeFaceFlags[face % CUBE_FACE_COUNT];
+            }
+            g = groups.erase(g);
+            continue;
+        }
+        group.faces = std::vector<int>();
+        ++g;
+    }
+
+    // Sizes first: the whole faces, then the merged groups' emissive quads
+    mesh.faces.assign(cubes.size() * CUBE_FACE_COUNT, MeshRange{0, 0});
+    size_t vertexCount = 0, litCount = 0, emissiveCount = 0;
+    CountCubeFaces(cubes, whole, mesh, vertexCount, litCount, emissiveCount);
+    for (auto& g : groups) {
+        vertexCount += g.second.vertexCount;
+        emissiveCount += g.second.parts.size() * 6;
+    }
+    mesh.vertexCount = vertexCount;
+    mesh.indexCount = litCount + emissiveCount;
+    mesh.emissive = MeshRange{(uint32_t)litCount, (uint32_t)emissiveCount};
+    out.allocate(mesh.vertexCount, mesh.indexCount);
+
+    LevelMeshBatcher batch(out, std::vector<size_t>{0, litCount});
+    StreamCubeFaces(cubes, whole, batch);
+    for (auto& g : groups) {
+        const GreedyMaterial m = groupMaterial(g);
+        placed.clear();
+        for (const FaceRect& r : g.second.parts) {
+            GreedyQuadCorners(m, g.first.second, r, [&](const std::array<float, 5>& v) {
+                auto found = placed.find(v);
+                uint32_t index = found != placed.end() ? found->second : (placed[v] = batch.AddVertex(v.data()));
+                batch.AddIndex(1, index);
+            });
+        }
+    }
+    batch.Flush();
+}
+
+// StreamGreedyLevelMesh into mesh's own vertices and indices
+inline void BuildGreedyLevelMesh(const std::vector<Cube>& cubes, LevelMesh& mesh)
+{
+    StreamGreedyLevelMesh(cubes, mesh, LevelMeshVectorOutput(mesh));
+}
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef LIGHTCACHE_H
+#define LIGHTCACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// On-disk lightmap bake cache. A baked lightmap is stored under the hash of
+// everything that went into it, so an unchanged scene finds its file and
+// skips baking. The file is a small header followed by the raw arrays:
+//
+//   char     magic[4]    "PXLM"
+//   uint32_t version     LIGHTMAP_CACHE_VERSION
+//   uint64_t hash        same as the file name
+//   int32_t  atlasWidth, atlasHeight, cubeCount, lightCount
+//   int32_t  charts[cubeCount * 6][4]             x, y, width, height
+//   float    texels[atlasWidth * atlasHeight]
+//   uint16_t visibility[cubeCount * 6][lightCount][width * height]
+//   uint8_t  centers[cubeCount * 6][lightCount][width * height]  adaptive AA only
+//
+// A light's visibility and center arrays are empty for charts outside its
+// radius.
+//
+// Everything is in host byte order; the hash covers the version, so files
+// from an older layout are simply never looked up.
+
+#define LIGHTMAP_CACHE_VERSION 5
+
+// FNV-1a, 64 bit
+class BakeHasher
+{
+public:
+    uint64_t value = 0xcbf29ce484222325ull;
+
+    void Add(const void* bytes, size_t count)
+    {
+        const uint8_t* p = (const uint8_t*)bytes;
+        for (size_t i = 0; i < count; i++) {
+            value ^= p[i];
+            value *= 0x100000001b3ull;
+        }
+    }
+
+    void Add(int32_t v)
+    {
+        Add(&v, sizeof(v));
+    }
+};
+
+struct LightMapCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t hash;
+    int32_t atlasWidth, atlasHeight;
+    int32_t cubeCount, lightCount;
+};
+
+typedef struct LightMapCacheHeader LightMapCacheHeader;
+
+inline std::string LightMapCachePath(const std::string& dir, uint64_t hash)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hash);
+    return dir + "/" + name;
+}
+
+// Read-only view of a whole cache file. Memory mapped where the platform
+// allows it, read into memory otherwise.
+class MappedFile
+{
+public:
+    const uint8_t* bytes = nullptr;
+    size_t size = 0;
+
+    bool Open(const std::string& path)
+    {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) { return false; }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+        void* mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) { return false; }
+        bytes = (const uint8_t*)mapping;
+        size = (size_t)st.st_size;
+        mapped = true;
+        return true;
+#else
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) { return false; }
+        fseek(f, 0, SEEK_END);
+        long length = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        if (length <= 0) {
+            fclose(f);
+            return false;
+        }
+        buffer.resize((size_t)length);
+        size_t got = fread(buffer.data(), 1, buffer.size(), f);
+        fclose(f);
+        if (got != buffer.size()) { return false; }
+        bytes = buffer.data();
+        size = buffer.size();
+        return true;
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifndef _WIN32
+        if (mapped) {
+            munmap((void*)bytes, size);
+        }
+#endif
+    }
+
+private:
+    bool mapped = false;
+    std::vector<uint8_t> buffer;
+};
+
+// Sequential reader over a cache file that refuses to run past the end
+class CacheReader
+{
+public:
+    CacheReader(const uint8_t* bytes, size_t size) : p(bytes), end(bytes + size) {}
+
+    bool Read(void* out, size_t count)
+    {
+        if ((size_t)(end - p) < count) { return false; }
+        memcpy(out, p, count);
+        p += count;
+        return true;
+    }
+
+    bool AtEnd() const
+    {
+        return p == end;
+    }
+
+private:
+    const uint8_t* p;
+    const uint8_t* end;
+};
+
+#endif
@@ -0,0 +1,2246 @@
+#ifndef LIGHTMAP_H
+#define LIGHTMAP_H
+
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "structs.h"
+#include "constants.h"
+#include "mesh.h"
+#include "occupancy.h"
+#include "bvh.h"
+#include "traversal.h"
+#include "threadpool.h"
+#include "packet.h"
+#include "atlas.h"
+#include "lightcache.h"
+#include "texelformat.h"
+#include "arealight.h"
+#include "radiosity.h"
+#include "polarshadow.h"
+#include "distancefield.h"
+#include "lighttree.h"
+
+// How the lightmap baker decides whether a light sample is blocked
+enum VisibilityMode {
+    VISIBILITY_MARCH, // fixed unit steps through CheckIfInsideCube
+    VISIBILITY_BVH,   // one segment query against the occluder BVH
+    VISIBILITY_DDA,   // exact cell walk through the occupancy grid
+    VISIBILITY_POLAR, // one lookup in the light's polar shadow map
+    VISIBILITY_SDF    // cell walk that jumps ahead through open space
+};
+
+// Block of texels in one chart, the unit of work when baking.
+// Covers [x0,x1) x [y0,y1).
+struct BakeTile {
+    int chart;
+    int x0, y0, x1, y1;
+};
+
+typedef struct BakeTile BakeTile;
+
+// One texel/light pair whose four AA samples need tracing
+struct TraceJob {
+    int chart;
+    int x, y;
+    int light;
+    // Light cuts only: the texel's whole cut rather than one light, picked
+    // and traced in one go. light is -1 then.
+    bool cut = false;
+};
+
+typedef struct TraceJob TraceJob;
+
+// Rows [first, first+count) of the lightmap texture
+struct RowSpan {
+    int first, count;
+};
+
+typedef struct RowSpan RowSpan;
+
+// Block of the lightmap texture, in texels
+struct AtlasRect {
+    int x, y, width, height;
+};
+
+typedef struct AtlasRect AtlasRect;
+
+// Where one cube face's lightmap sits in the atlas. x and y are the first
+// texel inside the padding, the chart covers width x height texels from
+// there. Faces without a lightmap have a 0 x 0 chart.
+struct LightMapChart {
+    int x, y, width, height;
+};
+
+typedef struct LightMapChart LightMapChart;
+
+// Where the rays of one chart texel start. Faces are lit through the layer
+// of grid cells just outside them, so a face never shadows itself and a
+// wall texel is only blocked by occluders at its own height.
+struct TexelOrigin {
+    // Start of every ray on the XZ plane, and the grid y it runs through
+    float x, z;
+    int layer;
+    // Texel corner the distance falloff is measured from
+    float cornerX, cornerZ;
+    // Walls only light from their front: axis 0 or 2 with the plane and
+    // outward side, -1 for floors and ceilings
+    int wallAxis;
+    float plane;
+    int sign;
+};
+
+typedef struct TexelOrigin TexelOrigin;
+
+inline float getDistance2D(float x0,float y0,float x1,float y1) {
+    return sqrt(pow(x1-x0,2)+pow(y1-y0,2));
+}
+
+// Traces the lightmaps for a set of cubes and lights. Knows nothing about GL,
+// it only fills a float buffer that the caller uploads.
+class LightMapBaker
+{
+public:
+    VisibilityMode visibilityMode = VISIBILITY_DDA;
+    // 1 bakes on the calling thread, 0 uses one worker per hardware thread
+    unsigned int workers = 0;
+    int tileSize = BAKE_TILE_SIZE;
+    // Widest packet the DDA kernel may use, detected from the running CPU
+    SimdLevel simdLevel = DetectSimdLevel();
+    // Adaptive AA: every texel first traces one ray to the middle of each
+    // light, and only texels whose neighbours disagree with them take
+    // adaptiveGrid x adaptiveGrid (2 to 4) stratified samples over the
+    // light's cell. Off, every texel takes four samples at its corners.
+    // Ignored while lightCuts is on.
+    bool adaptiveAA = false;
+    int adaptiveGrid = 4;
+    // Disc and rectangle lights take one sample per this many radians they
+    // cover as seen from the texel, within the AREA_LIGHT_* bounds. They
+    // always sample this way, adaptive AA or not.
+    float areaSampleSpacing = 0.1f;
+    // Polar mode only: AA samples look up to this many bins either side of
+    // the texel's own, a percentage-closer filter over the shadow map. 0
+    // gives every sample the same answer. Area lights have no polar map and
+    // take the DDA kernel.
+    int polarFilter = 0;
+    // SDF mode only: soft shadows from how close each texel's center ray
+    // passes to an occluder, spread over its AA samples. Larger softness
+    // gives harder edges. Area lights stay hard, they're soft already.
+    bool sdfSoftShadows = false;
+    float sdfSoftness = 8.0f;
+    // Bounces of indirect light added on top of the direct light, 0 for
+    // direct only. The solver's albedo and epsilon set how much comes back
+    // and how finely faces are split.
+    int indirectBounces = 0;
+    HierarchicalRadiosity radiosity;
+    // Lightcuts: point lights go into a tree of clusters, and each texel
+    // traces a cut through it instead of every light in reach. Clusters are
+    // split, and the representatives of the new ones traced, until the
+    // most the clusters between them could be off by, shadows and all, is
+    // within lightCutError of the light the texel is sure to get, or the
+    // cut holds lightCutMaxSize clusters. The cap wins over the bound: a
+    // texel that reaches it keeps its cut however far off that may be, and
+    // is counted in cutsCapped.
+    // Holding to it leaves out only lights that add little between them,
+    // so cuts save rays where many lights overlap faintly and cost more than
+    // tracing every light where a few overlap strongly. Area lights are
+    // left out and traced one by one.
+    bool lightCuts = false;
+    float lightCutError = 0.02f;
+    int lightCutMaxSize = 64;
+    LightTree lightTree;
+    // Rays traced by the last Bake or UpdateScene
+    std::atomic<uint64_t> samplesTraced{0};
+    // Texels whose light cut stopped at lightCutMaxSize short of the
+    // bound, in the last Bake or UpdateScene
+    std::atomic<uint64_t> cutsCapped{0};
+
+    std::vector<Cube> cubes;
+    std::vector<PointLight> lights;
+    // Occluder voxels and boxes, rebuilt by SetScene
+    OccupancyGrid occupancy;
+    CubeBVH occluderBVH;
+    // Polar mode only, one per light; empty for area lights
+    std::vector<PolarShadowMap> polarMaps;
+    // SDF mode only, every occupied layer
+    DistanceField2D distanceField;
+
+    // All face charts packed into one atlasWidth x atlasHeight texture.
+    // Chart cube*CUBE_FACE_COUNT + face belongs to that face of that cube.
+    std::vector<float> data;
+    int atlasWidth = 0;
+    int atlasHeight = 0;
+    // Format the atlas is handed out in for upload. Anything but float is
+    // kept in texels, converted from data whenever rows change. R8 maps
+    // [0, texelRange] onto its 256 steps.
+    LightMapFormat format = LIGHTMAP_FLOAT;
+    float texelRange = 2.0f;
+    std::vector<uint8_t> texels;
+    std::vector<LightMapChart> charts;
+    // Per chart and light, one bit per AA sample and chart texel telling
+    // whether that sample reached the light. Kept so an edit only re-traces
+    // what it touched.
+    std::vector<std::vector<std::vector<uint16_t>>> visibility;
+    // Adaptive AA only: whether each texel's center ray reached the light,
+    // same layout as visibility
+    std::vector<std::vector<std::vector<uint8_t>>> centerVisibility;
+    // Per chart, the lights whose radius reaches any part of its face, in
+    // order. A chart only stores visibility for, and only traces, these;
+    // the entries for every other light stay empty.
+    std::vector<std::vector<int>> chartLights;
+
+    // Light cuts only: per chart and texel, the nodes of lightTree in its
+    // cut, with the visibility bits of each node's representative. Picked
+    // as the texel is traced, so empty until then.
+    struct LightCutEntry {
+        int32_t node;
+        uint16_t mask;
+    };
+    std::vector<std::vector<std::vector<LightCutEntry>>> chartCuts;
+
+    // Takes the scene to bake. Everything built from it is left to
+    // PrepareScene, which a bake calls itself, so a progressive bake can
+    // start before the scene is ready to trace.
+    void SetScene(const std::vector<Cube>& newCubes, const std::vector<PointLight>& newLights)
+    {
+        cubes = newCubes;
+        lights = newLights;
+        faceFrames.clear();
+        for (auto& c : cubes) {
+            for (int f = 0; f < CUBE_FACE_COUNT; f++) {
+                faceFrames.push_back(GetCubeFace(c, f));
+            }
+        }
+        scenePrepared = false;
+    }
+
+    // Builds what tracing looks up for the scene: the occupancy grid, BVH,
+    // visibility maps and the lights of every chart. Also rebuilds whatever
+    // a setting changed since has made stale.
+    void PrepareScene()
+    {
+        if (!scenePrepared) {
+            occupancy.Build(cubes);
+            occluderBVH.Build(cubes);
+        }
+        if (!scenePrepared || mapsMode != visibilityMode) {
+            buildVisibilityMaps();
+        }
+        if (!scenePrepared || lightsInTree != lightCuts) {
+            assignLights();
+        }
+        scenePrepared = true;
+    }
+
+    // What a light adds to a texel per unreached sample, before shadowing.
+    // Falls off linearly and reaches zero at 1/falloff.
+    static float LightFalloff(float x, float z, const PointLight& l)
+    {
+        return 1.0f - getDistance2D(x, z, (float)l.pos.x, (float)l.pos.z) * l.falloff;
+    }
+
+    // Texels where a light's falloff has run out get nothing from it and
+    // are never traced towards it
+    static bool TexelInRange(const TexelOrigin& o, const PointLight& l)
+    {
+        return LightFalloff(o.cornerX, o.cornerZ, l) > 0;
+    }
+
+    // Could the light reach any texel of the face. Measured to the nearest
+    // point of the face's XZ bounds, which no texel corner is closer than.
+    static bool FaceInRange(const CubeFace& f, const PointLight& l)
+    {
+        float lo[3], hi[3];
+        for (int axis = 0; axis < 3; axis += 2) {
+            lo[axis] = f.origin[axis] + std::min(0.0f, f.u[axis]) + std::min(0.0f, f.v[axis]);
+            hi[axis] = f.origin[axis] + std::max(0.0f, f.u[axis]) + std::max(0.0f, f.v[axis]);
+        }
+        float nearestX = std::min(std::max((float)l.pos.x, lo[0]), hi[0]);
+        float nearestZ = std::min(std::max((float)l.pos.z, lo[2]), hi[2]);
+        return LightFalloff(nearestX, nearestZ, l) > 0;
+    }
+
+    // Does the light go into the light tree rather than chartLights
+    bool InLightTree(int light) const
+    {
+        return lightsInTree && !IsAreaLight(lights[light]);
+    }
+
+    bool ChartReaches(int chart, int light) const
+    {
+        return std::binary_search(chartLights[chart].begin(), chartLights[chart].end(), light);
+    }
+
+    // Texel size of a face's chart. Every face of a cube gets the same
+    // texel density, lightMapScale texels along the cube's biggest
+    // dimension. Emissive cubes never sample the lightmap, and faces that
+    // aren't in exposed (ExposedFaces of the scene) get no chart at all.
+    static LightMapChart ChartSize(const std::vector<Cube>& scene, const std::vector<uint8_t>& exposed, int cube, int face)
+    {
+        const Cube& c = scene[cube];
+        LightMapChart none{0, 0, 0, 0};
+        if (c.emissive || !(exposed[cube] & cubeFaceFlags[face])) { return none; }
+
+        CubeFace f = GetCubeFace(c, face);
+        float lengthU = std::sqrt(f.u[0]*f.u[0] + f.u[1]*f.u[1] + f.u[2]*f.u[2]);
+        float lengthV = std::sqrt(f.v[0]*f.v[0] + f.v[1]*f.v[1] + f.v[2]*f.v[2]);
+
+        Int3 extent = MaxInt3(c.cornerA, c.cornerB);
+        Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+        int biggest = std::max(extent.x - minCorner.x, std::max(extent.y - minCorner.y, extent.z - minCorner.z));
+        float density = c.lightMapScale / (float)biggest;
+        return LightMapChart{0, 0,
+            std::max(1, (int)std::lround(lengthU * density)),
+            std::max(1, (int)std::lround(lengthV * density))};
+    }
+
+    // Traces every cube's lightmap from scratch. Each texel is computed the
+    // same way whichever thread picks up its tile, so the result doesn't
+    // depend on the worker count.
+    // With adaptive AA every center ray is traced before any tile looks
+    // at its neighbours, in a pass of its own.
+    void Bake()
+    {
+        resetBake();
+        std::vector<BakeTile> tiles = MakeTiles();
+        if (AdaptiveAA()) {
+            runParallel((int)tiles.size(), [&](int i) {
+                std::vector<TraceJob> jobs = tileJobs(tiles[i]);
+                TraceCenters(jobs.data(), (int)jobs.size());
+            });
+        }
+        runParallel((int)tiles.size(), [&](int i) {
+            const BakeTile& t = tiles[i];
+            std::vector<TraceJob> jobs = tileJobs(t);
+            if (AdaptiveAA()) {
+                RefineJobs(jobs.data(), (int)jobs.size());
+            } else {
+                TraceJobs(jobs.data(), (int)jobs.size());
+            }
+            for (int y = t.y0; y < t.y1; y++) {
+                for (int x = t.x0; x < t.x1; x++) {
+                    writeTexel(t.chart, x, y, ResolveTexel(t.chart, x, y));
+                }
+            }
+        });
+        if (indirectBounces > 0) {
+            SolveIndirect();
+        }
+        EncodeRows(0, atlasHeight);
+        baked = true;
+        bakedSettings = bakeSettings();
+    }
+
+    // Starts a bake that StepProgressiveBake carries out a slice at a time,
+    // so a window can keep drawing while it runs. Every tile first gets an
+    // unshadowed estimate, which the shadowed result then replaces tile by
+    // tile. Only packs the atlas here, so the texture can be allocated
+    // straight away; the scene is prepared and the visibility bits laid out
+    // in the first steps. Texels start out at zero and the texture needn't
+    // be uploaded, the estimate covers every chart. Bake or a new
+    // BeginProgressiveBake drops a bake in progress.
+    void BeginProgressiveBake()
+    {
+        progressPhase = PROGRESS_IDLE;
+        baked = false;
+        PackCharts();
+        // Zero bytes are zero in every upload format
+        texels.assign(format == LIGHTMAP_FLOAT ? 0 : (size_t)atlasWidth * atlasHeight * TexelFormatBytes(format), 0);
+        samplesTraced = 0;
+        cutsCapped = 0;
+        progressTiles = MakeTiles();
+        progressNext = 0;
+        progressPhase = PROGRESS_SCENE;
+    }
+
+    bool ProgressiveBaking() const
+    {
+        return progressPhase != PROGRESS_IDLE;
+    }
+
+    // Share of the progressive bake's passes over the tiles done so far
+    float ProgressiveBakeDone() const
+    {
+        if (progressPhase == PROGRESS_IDLE) { return 1.0f; }
+        // Preparing the scene doesn't count as a pass
+        if (progressPhase < PROGRESS_COARSE) { return 0.0f; }
+        int passes = (AdaptiveAA() ? 3 : 2) + (indirectBounces > 0 ? 1 : 0);
+        float tiles = std::max<size_t>(1, progressTiles.size());
+        if (progressPhase >= PROGRESS_LINKS) {
+            // The bounced light pass is split evenly between its steps
+            float faces = std::max(1, radiosity.FaceCount());
+            float steps[] = {faces, faces, faces, (float)std::max(1, indirectBounces), tiles};
+            int stage = progressPhase - PROGRESS_LINKS;
+            return (passes - 1 + (stage + progressNext / steps[stage]) / 5.0f) / passes;
+        }
+        int pass = progressPhase == PROGRESS_COARSE ? 0 : (progressPhase == PROGRESS_CENTERS ? 1 : (AdaptiveAA() ? 2 : 1));
+        return (pass + progressNext / tiles) / passes;
+    }
+
+    // Works on the progressive bake until budgetMs has gone by, a batch of
+    // tiles (one per worker) at a time, so a batch can run over the budget
+    // by up to one tile. Returns the texture blocks whose texels changed,
+    // already converted for upload. Once the last tile is traced the baker
+    // ends up exactly as if Bake had run.
+    std::vector<AtlasRect> StepProgressiveBake(double budgetMs)
+    {
+        std::vector<AtlasRect> rects;
+        auto start = std::chrono::steady_clock::now();
+        auto elapsedMs = [&start]() {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        };
+        int batch = (int)std::max(1u, workers != 0 ? workers : std::thread::hardware_concurrency());
+        // At least one batch per step, or a small budget would never finish
+        for (int step = 0; progressPhase != PROGRESS_IDLE && (step == 0 || elapsedMs() < budgetMs); step++) {
+            if (progressPhase < PROGRESS_COARSE) {
+                stepScene(batch);
+                continue;
+            }
+            if (progressPhase >= PROGRESS_LINKS) {
+                stepIndirect(batch, rects);
+                continue;
+            }
+            int first = progressNext;
+            int count = std::min(batch, (int)progressTiles.size() - first);
+            runParallel(count, [&](int i) {
+                const BakeTile& t = progressTiles[first + i];
+                if (progressPhase == PROGRESS_COARSE) {
+                    for (int y = t.y0; y < t.y1; y++) {
+                        for (int x = t.x0; x < t.x1; x++) {
+                            writeTexel(t.chart, x, y, CoarseTexel(t.chart, x, y));
+                        }
+                    }
+                    return;
+                }
+                std::vector<TraceJob> jobs = tileJobs(t);
+                if (progressPhase == PROGRESS_CENTERS) {
+                    TraceCenters(jobs.data(), (int)jobs.size());
+                    return;
+                }
+                if (AdaptiveAA()) {
+                    RefineJobs(jobs.data(), (int)jobs.size());
+                } else {
+                    TraceJobs(jobs.data(), (int)jobs.size());
+                }
+                for (int y = t.y0; y < t.y1; y++) {
+                    for (int x = t.x0; x < t.x1; x++) {
+                        writeTexel(t.chart, x, y, ResolveTexel(t.chart, x, y));
+                    }
+                }
+            });
+            if (progressPhase != PROGRESS_CENTERS) {
+                for (int i = first; i < first + count; i++) {
+                    rects.push_back(tileRect(progressTiles[i]));
+                    EncodeRect(rects.back());
+                }
+            }
+            progressNext += count;
+            if (progressNext < (int)progressTiles.size()) { continue; }
+
+            // Adaptive AA needs every center ray before any tile refines
+            progressNext = 0;
+            if (progressPhase == PROGRESS_COARSE) {
+                progressPhase = AdaptiveAA() ? PROGRESS_CENTERS : PROGRESS_TRACE;
+            } else if (progressPhase == PROGRESS_CENTERS) {
+                progressPhase = PROGRESS_TRACE;
+            } else if (indirectBounces > 0) {
+                // Bounced light spans the whole scene, so it waits for every
+                // tile and then goes in steps of its own
+                beginIndirect(nullptr);
+                progressPair = 0;
+                progressPhase = PROGRESS_LINKS;
+            } else {
+                endProgressiveBake();
+            }
+        }
+        return rects;
+    }
+
+    // Adds indirectBounces bounces of light to every texel with the
+    // radiosity solver, from the direct light the visibility bits give.
+    // Without dirty the links are built afresh; with it they're brought up
+    // to date, dirty holding boxes around the occluders edited since.
+    void SolveIndirect(const CubeBVH* dirty = nullptr)
+    {
+        beginIndirect(dirty);
+        radiosity.LinkFaces(0, radiosity.FaceCount(), radiosityParallel());
+        radiosity.EndLinks();
+        radiosity.PatchFaces(0, radiosity.FaceCount());
+        runParallel((int)charts.size(), [&](int chart) {
+            setBounceDirect(chart);
+        });
+        for (int bounce = 0; bounce < indirectBounces; bounce++) {
+            radiosity.Bounce();
+        }
+        // Charts and their padding never overlap, so every chart can be
+        // written at once
+        runParallel((int)charts.size(), [&](int chart) {
+            for (int y = 0; y < charts[chart].height; y++) {
+                for (int x = 0; x < charts[chart].width; x++) {
+                    writeBounced(chart, x, y);
+                }
+            }
+        });
+        bounceDirect.clear();
+    }
+
+    // Hash of everything that decides the baked result: occluder and chart
+    // geometry in order, lights, the visibility kernel and the atlas layout
+    // rules. Thread count, tile size and SIMD level don't change the output
+    // and are left out.
+    uint64_t HashInputs() const
+    {
+        BakeHasher h;
+        h.Add(LIGHTMAP_CACHE_VERSION);
+        h.Add(LIGHTMAP_CHART_PADDING);
+        h.Add((int32_t)visibilityMode);
+        h.Add((int32_t)AdaptiveAA());
+        h.Add((int32_t)(AdaptiveAA() ? AdaptiveGrid() : 0));
+        h.Add((int32_t)(visibilityMode == VISIBILITY_POLAR ? polarFilter : 0));
+        h.Add((int32_t)(visibilityMode == VISIBILITY_SDF && sdfSoftShadows));
+        float softness = visibilityMode == VISIBILITY_SDF && sdfSoftShadows ? sdfSoftness : 0.0f;
+        h.Add(&softness, sizeof(softness));
+        h.Add((int32_t)lightCuts);
+        float cutError = lightCuts ? lightCutError : 0.0f;
+        h.Add(&cutError, sizeof(cutError));
+        h.Add((int32_t)(lightCuts ? std::max(1, lightCutMaxSize) : 0));
+        h.Add((int32_t)cubes.size());
+        for (auto& c : cubes) {
+            Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+            Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+            h.Add(minCorner.x); h.Add(minCorner.y); h.Add(minCorner.z);
+            h.Add(maxCorner.x); h.Add(maxCorner.y); h.Add(maxCorner.z);
+            // Which corner is which decides how faces map onto their charts
+            h.Add((int32_t)((c.cornerA.x < c.cornerB.x) | (c.cornerA.y < c.cornerB.y) << 1 | (c.cornerA.z < c.cornerB.z) << 2));
+            h.Add((int32_t)c.occluder);
+            h.Add((int32_t)c.emissive);
+            h.Add((int32_t)c.faces);
+            h.Add(c.lightMapScale);
+        }
+        h.Add((int32_t)lights.size());
+        for (auto& l : lights) {
+            h.Add(l.pos.x); h.Add(l.pos.y); h.Add(l.pos.z);
+            h.Add(&l.falloff, sizeof(l.falloff));
+            h.Add((int32_t)l.shape);
+            h.Add(&l.sizeX, sizeof(l.sizeX));
+            h.Add(&l.sizeZ, sizeof(l.sizeZ));
+        }
+        h.Add(&areaSampleSpacing, sizeof(areaSampleSpacing));
+        h.Add((int32_t)indirectBounces);
+        if (indirectBounces > 0) {
+            h.Add(&radiosity.albedo, sizeof(radiosity.albedo));
+            h.Add(&radiosity.epsilon, sizeof(radiosity.epsilon));
+            h.Add(&radiosity.minFormFactor, sizeof(radiosity.minFormFactor));
+        }
+        return h.value;
+    }
+
+    // Loads the bake for the current scene from dir if one was saved before.
+    // On a hit the baker ends up exactly as if Bake had run.
+    bool LoadFromCache(const std::string& dir)
+    {
+        uint64_t hash = HashInputs();
+        MappedFile file;
+        if (!file.Open(LightMapCachePath(dir, hash))) { return false; }
+        PrepareScene();
+        CacheReader in(file.bytes, file.size);
+
+        LightMapCacheHeader header;
+        if (!in.Read(&header, sizeof(header)) ||
+            memcmp(header.magic, "PXLM", 4) != 0 ||
+            header.version != LIGHTMAP_CACHE_VERSION ||
+            header.hash != hash ||
+            header.cubeCount != (int32_t)cubes.size() ||
+            header.lightCount != (int32_t)lights.size() ||
+            header.atlasWidth <= 0 || header.atlasHeight <= 0) {
+            return false;
+        }
+
+        std::vector<LightMapChart> loadedCharts(cubes.size() * CUBE_FACE_COUNT);
+        for (auto& c : loadedCharts) {
+            int32_t rect[4];
+            if (!in.Read(rect, sizeof(rect))) { return false; }
+            c = LightMapChart{rect[0], rect[1], rect[2], rect[3]};
+            if (c.width < 0 || c.height < 0 || c.x < 0 || c.y < 0 ||
+                c.x + c.width > header.atlasWidth || c.y + c.height > header.atlasHeight) {
+                return false;
+            }
+        }
+        std::vector<float> loadedData((size_t)header.atlasWidth * header.atlasHeight);
+        if (!in.Read(loadedData.data(), loadedData.size() * sizeof(float))) { return false; }
+        std::vector<std::vector<std::vector<uint16_t>>> loadedVisibility(loadedCharts.size());
+        for (size_t chart = 0; chart < loadedCharts.size(); chart++) {
+            size_t texels = (size_t)loadedCharts[chart].width * loadedCharts[chart].height;
+            loadedVisibility[chart].resize(lights.size());
+            for (int li : chartLights[chart]) {
+                loadedVisibility[chart][li].resize(texels);
+            }
+            for (auto& v : loadedVisibility[chart]) {
+                if (!in.Read(v.data(), v.size() * sizeof(uint16_t))) { return false; }
+            }
+        }
+        std::vector<std::vector<std::vector<uint8_t>>> loadedCenters(AdaptiveAA() ? loadedCharts.size() : 0);
+        for (size_t chart = 0; chart < loadedCenters.size(); chart++) {
+            size_t texels = (size_t)loadedCharts[chart].width * loadedCharts[chart].height;
+            loadedCenters[chart].resize(lights.size());
+            for (int li : chartLights[chart]) {
+                loadedCenters[chart][li].resize(texels);
+            }
+            for (auto& v : loadedCenters[chart]) {
+                if (!in.Read(v.data(), v.size())) { return false; }
+            }
+        }
+        if (!in.AtEnd()) { return false; }
+
+        atlasWidth = header.atlasWidth;
+        atlasHeight = header.atlasHeight;
+        charts.swap(loadedCharts);
+        data.swap(loadedData);
+        visibility.swap(loadedVisibility);
+        centerVisibility.swap(loadedCenters);
+        // Light cuts aren't stored; they're left empty, so the next edit
+        // bakes from scratch
+        if (lightsInTree) {
+            chartCuts.assign(charts.size(), std::vector<std::vector<LightCutEntry>>());
+            for (int chart = 0; chart < (int)charts.size(); chart++) {
+                resetCuts(chart);
+            }
+        }
+        // Nor are the radiosity links, so the next edit links every pair again
+        radiosity.Clear();
+        // The skyline isn't stored, so the next edit that adds a chart repacks
+        packer.Reset(0);
+        EncodeRows(0, atlasHeight);
+        progressPhase = PROGRESS_IDLE;
+        progressTiles.clear();
+        baked = !lightsInTree;
+        bakedSettings = bakeSettings();
+        return true;
+    }
+
+    // Writes the current bake to dir. Goes through a temporary file so a
+    // crash half way never leaves a truncated entry behind.
+    bool SaveToCache(const std::string& dir) const
+    {
+        std::error_code error;
+        std::filesystem::create_directories(dir, error);
+
+        uint64_t hash = HashInputs();
+        std::string path = LightMapCachePath(dir, hash);
+        std::string temp = path + ".tmp";
+        FILE* f = fopen(temp.c_str(), "wb");
+        if (!f) { return false; }
+
+        LightMapCacheHeader header;
+        memcpy(header.magic, "PXLM", 4);
+        header.version = LIGHTMAP_CACHE_VERSION;
+        header.hash = hash;
+        header.atlasWidth = atlasWidth;
+        header.atlasHeight = atlasHeight;
+        header.cubeCount = (int32_t)cubes.size();
+        header.lightCount = (int32_t)lights.size();
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+        for (auto& c : charts) {
+            int32_t rect[4] = {c.x, c.y, c.width, c.height};
+            ok = ok && fwrite(rect, sizeof(rect), 1, f) == 1;
+        }
+        ok = ok && fwrite(data.data(), sizeof(float), data.size(), f) == data.size();
+        for (auto& perChart : visibility) {
+            for (auto& v : perChart) {
+                ok = ok && fwrite(v.data(), sizeof(uint16_t), v.size(), f) == v.size();
+            }
+        }
+        for (auto& perChart : centerVisibility) {
+            for (auto& v : perChart) {
+                ok = ok && fwrite(v.data(), 1, v.size(), f) == v.size();
+            }
+        }
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || std::rename(temp.c_str(), path.c_str()) != 0) {
+            std::remove(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Sizes and lays every chart out from scratch. Tall charts go in first,
+    // which packs tighter. The atlas is a power of two wide, enough for the
+    // widest chart and for the total area to come out roughly square.
+    void PackCharts()
+    {
+        const int pad = LIGHTMAP_CHART_PADDING;
+        charts.assign(cubes.size() * CUBE_FACE_COUNT, LightMapChart{0, 0, 0, 0});
+        std::vector<uint8_t> exposed = ExposedFaces(cubes);
+        std::vector<int> order;
+        size_t area = 0;
+        int widest = 0;
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            charts[chart] = ChartSize(cubes, exposed, chart / CUBE_FACE_COUNT, chart % CUBE_FACE_COUNT);
+            if (charts[chart].width == 0) { continue; }
+            order.push_back(chart);
+            area += (size_t)(charts[chart].width + 2*pad) * (charts[chart].height + 2*pad);
+            widest = std::max(widest, charts[chart].width + 2*pad);
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+            return charts[a].height > charts[b].height;
+        });
+
+        int width = 64;
+        while (width < widest || (size_t)width * width < area) {
+            width *= 2;
+        }
+        packer.Reset(width);
+        for (int chart : order) {
+            placeChart(chart);
+        }
+        atlasWidth = packer.width;
+        atlasHeight = std::max(1, packer.height);
+        data.assign((size_t)atlasWidth * atlasHeight, 0.0f);
+    }
+
+    // Brings the lightmap in line with an edited scene. Cubes and lights are
+    // matched up by index against the last baked scene:
+    //  - a moved, added or removed occluder only re-traces the texel/light
+    //    pairs whose samples pass over its old or new box
+    //  - a moved, added or re-ranged light re-traces that light alone, over
+    //    the texels in its radius
+    //  - an edited or new cube, and any face whose chart changed size (a
+    //    neighbour now hides or uncovers it, say), is traced in full
+    // Returns the texture rows whose values actually changed.
+    std::vector<RowSpan> UpdateScene(const std::vector<Cube>& newCubes, const std::vector<PointLight>& newLights)
+    {
+        // Nothing is traced for good yet, so a bake in progress starts over
+        // on the new scene
+        if (ProgressiveBaking()) {
+            SetScene(newCubes, newLights);
+            BeginProgressiveBake();
+            return std::vector<RowSpan>{RowSpan{0, atlasHeight}};
+        }
+        // The stored visibility bits only make sense for the settings they
+        // were traced with
+        // With light cuts, an edited light changes the tree and with it the
+        // cut of every texel
+        if (!baked || bakedSettings != bakeSettings() || (lightsInTree && !sameLights(lights, newLights))) {
+            SetScene(newCubes, newLights);
+            Bake();
+            return std::vector<RowSpan>{RowSpan{0, atlasHeight}};
+        }
+
+        // Boxes around every occluder that appeared, vanished or changed.
+        // Grown by a cell so corner-grazing samples are always caught.
+        std::vector<Cube> dirtyBoxes;
+        std::vector<LightMapChart> sizes(newCubes.size() * CUBE_FACE_COUNT);
+        std::vector<bool> fullChart(sizes.size(), false);
+        // Existing charts only keep their place if nothing was removed or resized
+        bool repack = newCubes.size() < cubes.size();
+        std::vector<uint8_t> exposed = ExposedFaces(newCubes);
+        for (size_t i = 0; i < std::max(cubes.size(), newCubes.size()); i++) {
+            const Cube* before = i < cubes.size() ? &cubes[i] : nullptr;
+            const Cube* after = i < newCubes.size() ? &newCubes[i] : nullptr;
+            if (after) {
+                bool edited = !before || !sameCharts(*before, *after);
+                for (int f = 0; f < CUBE_FACE_COUNT; f++) {
+                    size_t chart = i * CUBE_FACE_COUNT + f;
+                    sizes[chart] = ChartSize(newCubes, exposed, (int)i, f);
+                    bool resized = before && (charts[chart].width != sizes[chart].width || charts[chart].height != sizes[chart].height);
+                    fullChart[chart] = edited || resized;
+                    repack |= resized;
+                }
+            }
+            if (before && after && sameOccluder(*before, *after)) { continue; }
+            if (before && before->occluder) { dirtyBoxes.push_back(grownBox(*before)); }
+            if (after && after->occluder) { dirtyBoxes.push_back(grownBox(*after)); }
+        }
+
+        std::vector<bool> fullLight(newLights.size(), false);
+        for (size_t i = 0; i < newLights.size(); i++) {
+            if (i >= lights.size() || !sameLight(lights[i], newLights[i])) {
+                fullLight[i] = true;
+            }
+        }
+        // Lights that moved or went away, as they were: the texels they used
+        // to reach lose their contribution
+        std::vector<PointLight> oldLights;
+        for (size_t i = 0; i < lights.size(); i++) {
+            if (i >= newLights.size() || fullLight[i]) {
+                oldLights.push_back(lights[i]);
+            }
+        }
+
+        std::vector<float> previous = data;
+        size_t oldChartCount = charts.size();
+        SetScene(newCubes, newLights);
+        PrepareScene();
+
+        // New charts are added to the skyline if they fit, anything else
+        // means a fresh layout
+        if (!repack) {
+            int oldHeight = atlasHeight;
+            charts.resize(sizes.size(), LightMapChart{0, 0, 0, 0});
+            for (size_t chart = oldChartCount; chart < charts.size() && !repack; chart++) {
+                charts[chart] = sizes[chart];
+                repack = charts[chart].width != 0 && !placeChart((int)chart);
+            }
+            if (!repack && packer.height > oldHeight) {
+                atlasHeight = packer.height;
+                data.resize((size_t)atlasWidth * atlasHeight, 0.0f);
+            }
+        }
+        if (repack) {
+            PackCharts();
+        }
+
+        // Visibility stays valid for every chart that was neither edited nor
+        // resized, since a chart's texels only depend on its face and the scene
+        visibility.resize(charts.size());
+        centerVisibility.resize(AdaptiveAA() ? charts.size() : 0);
+        chartCuts.resize(lightsInTree ? charts.size() : 0);
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            if (fullChart[chart]) {
+                resetVisibility(chart);
+            } else {
+                // Edited lights may now reach a different set of charts
+                size_t texels = (size_t)charts[chart].width * charts[chart].height;
+                visibility[chart].resize(lights.size());
+                if (AdaptiveAA()) {
+                    centerVisibility[chart].resize(lights.size());
+                }
+                for (int li = 0; li < (int)lights.size(); li++) {
+                    if (!fullLight[li]) { continue; }
+                    size_t size = ChartReaches(chart, li) ? texels : 0;
+                    visibility[chart][li].assign(size, 0);
+                    if (AdaptiveAA()) {
+                        centerVisibility[chart][li].assign(size, 0);
+                    }
+                }
+            }
+        }
+
+        CubeBVH dirtyBVH;
+        dirtyBVH.Build(dirtyBoxes);
+
+        // Gather what needs tracing, and which texels need summing up again
+        std::vector<TraceJob> jobs;
+        std::vector<std::vector<uint8_t>> touched(charts.size());
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            touched[chart].assign((size_t)charts[chart].width * charts[chart].height, 0);
+            for (int y = 0; y < charts[chart].height; y++) {
+                for (int x = 0; x < charts[chart].width; x++) {
+                    TexelOrigin o = GetTexelOrigin(chart, x, y);
+                    for (int li : chartLights[chart]) {
+                        if (!TexelInRange(o, lights[li])) { continue; }
+                        if (fullChart[chart] || fullLight[li] || samplesCross(dirtyBVH, o, li)) {
+                            jobs.push_back(TraceJob{chart, x, y, li});
+                            touched[chart][x + y * charts[chart].width] = 1;
+                        }
+                    }
+                    // A cut stays good for as long as the light its
+                    // representatives bring does
+                    if (lightsInTree) {
+                        bool retrace = fullChart[chart];
+                        for (const LightCutEntry& e : chartCuts[chart][x + y * charts[chart].width]) {
+                            retrace = retrace || samplesCross(dirtyBVH, o, lightTree.nodes[e.node].light);
+                        }
+                        if (retrace) {
+                            jobs.push_back(TraceJob{chart, x, y, -1, true});
+                            touched[chart][x + y * charts[chart].width] = 1;
+                        }
+                    }
+                    for (auto& l : oldLights) {
+                        if (TexelInRange(o, l)) {
+                            touched[chart][x + y * charts[chart].width] = 1;
+                        }
+                    }
+                }
+            }
+        }
+
+        const int chunk = tileSize * tileSize;
+        samplesTraced = 0;
+        cutsCapped = 0;
+        if (!AdaptiveAA()) {
+            runParallel(((int)jobs.size() + chunk - 1) / chunk, [&](int i) {
+                int first = i * chunk;
+                TraceJobs(jobs.data() + first, std::min(chunk, (int)jobs.size() - first));
+            });
+        } else {
+            runParallel(((int)jobs.size() + chunk - 1) / chunk, [&](int i) {
+                int first = i * chunk;
+                TraceCenters(jobs.data() + first, std::min(chunk, (int)jobs.size() - first));
+            });
+            // A new center ray can turn its neighbours into edge texels or
+            // back, so they are refined along with it
+            std::vector<TraceJob> refine;
+            for (const TraceJob& job : jobs) {
+                // Cuts skip the center pass and are traced as they are
+                if (job.cut) {
+                    refine.push_back(job);
+                    continue;
+                }
+                const int offsets[5][2] = {{0,0}, {-1,0}, {1,0}, {0,-1}, {0,1}};
+                for (auto& offset : offsets) {
+                    int x = job.x + offset[0], y = job.y + offset[1];
+                    if (x < 0 || y < 0 || x >= charts[job.chart].width || y >= charts[job.chart].height) { continue; }
+                    if (!TexelInRange(GetTexelOrigin(job.chart, x, y), lights[job.light])) { continue; }
+                    refine.push_back(TraceJob{job.chart, x, y, job.light});
+                    touched[job.chart][x + y * charts[job.chart].width] = 1;
+                }
+            }
+            auto order = [](const TraceJob& a, const TraceJob& b) {
+                if (a.chart != b.chart) { return a.chart < b.chart; }
+                if (a.light != b.light) { return a.light < b.light; }
+                if (a.cut != b.cut) { return a.cut < b.cut; }
+                if (a.y != b.y) { return a.y < b.y; }
+                return a.x < b.x;
+            };
+            auto same = [](const TraceJob& a, const TraceJob& b) {
+                return a.chart == b.chart && a.light == b.light && a.cut == b.cut && a.x == b.x && a.y == b.y;
+            };
+            std::sort(refine.begin(), refine.end(), order);
+            refine.erase(std::unique(refine.begin(), refine.end(), same), refine.end());
+            runParallel(((int)refine.size() + chunk - 1) / chunk, [&](int i) {
+                int first = i * chunk;
+                RefineJobs(refine.data() + first, std::min(chunk, (int)refine.size() - first));
+            });
+        }
+
+        // A re-traced chart is summed up in full, texels no light reaches
+        // included, and a new layout moves every texel
+        std::vector<int> resolve;
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            for (int y = 0; y < charts[chart].height; y++) {
+                for (int x = 0; x < charts[chart].width; x++) {
+                    if (touched[chart][x + y * charts[chart].width] || fullChart[chart] || repack) {
+                        resolve.push_back(chart);
+                        resolve.push_back(x);
+                        resolve.push_back(y);
+                    }
+                }
+            }
+        }
+        int texelCount = (int)resolve.size() / 3;
+        runParallel((texelCount + chunk - 1) / chunk, [&](int i) {
+            for (int r = i * chunk; r < std::min(texelCount, (i + 1) * chunk); r++) {
+                int chart = resolve[r*3], x = resolve[r*3+1], y = resolve[r*3+2];
+                writeTexel(chart, x, y, ResolveTexel(chart, x, y));
+            }
+        });
+
+        // Any edit can change the light bounced anywhere, though only links
+        // near it need tracing again
+        if (indirectBounces > 0) {
+            SolveIndirect(&dirtyBVH);
+        }
+
+        if (repack) {
+            EncodeRows(0, atlasHeight);
+            return std::vector<RowSpan>{RowSpan{0, atlasHeight}};
+        }
+        std::vector<RowSpan> spans = changedRows(previous);
+        for (auto& span : spans) {
+            EncodeRows(span.first, span.count);
+        }
+        return spans;
+    }
+
+    // Brings rows [first, first+count) of texels up to date with data
+    void EncodeRows(int first, int count)
+    {
+        if (format == LIGHTMAP_FLOAT) {
+            texels.clear();
+            return;
+        }
+        size_t rowBytes = (size_t)atlasWidth * TexelFormatBytes(format);
+        texels.resize(rowBytes * atlasHeight);
+        size_t offset = (size_t)first * atlasWidth;
+        ConvertTexels(data.data() + offset, (size_t)count * atlasWidth, format, texelRange,
+            texels.data() + (size_t)first * rowBytes, simdLevel);
+    }
+
+    // Brings one block of texels up to date with data, a row at a time
+    void EncodeRect(const AtlasRect& r)
+    {
+        if (format == LIGHTMAP_FLOAT) {
+            texels.clear();
+            return;
+        }
+        size_t texelBytes = TexelFormatBytes(format);
+        texels.resize((size_t)atlasWidth * atlasHeight * texelBytes);
+        for (int row = r.y; row < r.y + r.height; row++) {
+            size_t offset = (size_t)row * atlasWidth + r.x;
+            ConvertTexels(data.data() + offset, r.width, format, texelRange,
+                texels.data() + offset * texelBytes, simdLevel);
+        }
+    }
+
+    // Start of a row in the format being uploaded
+    const void* UploadRow(int row) const
+    {
+        return UploadTexel(0, row);
+    }
+
+    // One texel in the format being uploaded. Rows are atlasWidth texels
+    // apart, which is what GL_UNPACK_ROW_LENGTH needs for a block upload.
+    const void* UploadTexel(int x, int y) const
+    {
+        size_t index = (size_t)x + (size_t)y * atlasWidth;
+        if (format == LIGHTMAP_FLOAT) {
+            return data.data() + index;
+        }
+        return texels.data() + index * TexelFormatBytes(format);
+    }
+
+    // Texels across all charts
+    size_t TexelCount() const
+    {
+        size_t count = 0;
+        for (auto& c : charts) {
+            count += (size_t)c.width * c.height;
+        }
+        return count;
+    }
+
+    std::vector<BakeTile> MakeTiles() const
+    {
+        std::vector<BakeTile> tiles;
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            int width = charts[chart].width;
+            int height = charts[chart].height;
+            for (int y = 0; y < height; y += tileSize) {
+                for (int x = 0; x < width; x += tileSize) {
+                    tiles.push_back(BakeTile{chart, x, y, std::min(x + tileSize, width), std::min(y + tileSize, height)});
+                }
+            }
+        }
+        return tiles;
+    }
+
+    // Position of a chart texel in the atlas
+    size_t TexelIndex(int chart, int x, int y) const
+    {
+        const LightMapChart& c = charts[chart];
+        return (size_t)(c.x + x) + (size_t)(c.y + y) * atlasWidth;
+    }
+
+    // Works out where a chart texel's rays start. Texel (x,y) sits at
+    // texture coordinate ((x+0.5)/width, (y+0.5)/height) of its face.
+    TexelOrigin GetTexelOrigin(int chart, int x, int y) const
+    {
+        const LightMapChart& c = charts[chart];
+        const CubeFace& f = faceFrames[chart];
+        const Cube& cube = cubes[chart / CUBE_FACE_COUNT];
+        float s = (x + 0.5f) / c.width, t = (y + 0.5f) / c.height;
+        float cornerS = x / (float)c.width, cornerT = y / (float)c.height;
+        float p[3], corner[3];
+        for (int axis = 0; axis < 3; axis++) {
+            p[axis] = f.origin[axis] + f.u[axis] * s + f.v[axis] * t;
+            corner[axis] = f.origin[axis] + f.u[axis] * cornerS + f.v[axis] * cornerT;
+        }
+
+        // First cell out from the face. An occluder's cells run up to and
+        // including its max corner, so its positive faces start one further.
+        int plane = (int)std::floor(f.plane);
+        int outside = f.sign > 0 ? plane + (cube.occluder ? 1 : 0) : plane - 1;
+
+        TexelOrigin o;
+        o.cornerX = corner[0];
+        o.cornerZ = corner[2];
+        o.plane = f.plane;
+        o.sign = f.sign;
+        if (f.axis == 1) {
+            o.layer = outside;
+            o.wallAxis = -1;
+        } else {
+            o.layer = (int)std::floor(p[1]);
+            o.wallAxis = f.axis;
+            p[f.axis] = outside + 0.5f;
+        }
+        o.x = p[0];
+        o.z = p[2];
+        return o;
+    }
+
+    // Samples each texel takes per light: 4 corners of the light's cell, or
+    // the adaptive grid
+    int SampleCount() const
+    {
+        return AdaptiveAA() ? AdaptiveGrid() * AdaptiveGrid() : 4;
+    }
+
+    int AdaptiveGrid() const
+    {
+        return std::min(4, std::max(2, adaptiveGrid));
+    }
+
+    // Adaptive AA as the bake runs it. A cut's error bound holds against
+    // the full sample set of each light, and adaptive AA's center rays give
+    // most texels something else, so it's off while light cuts are on.
+    bool AdaptiveAA() const
+    {
+        return adaptiveAA && !lightCuts;
+    }
+
+    // Fills in the visibility bits for every job from a full set of samples
+    void TraceJobs(const TraceJob* jobs, int count)
+    {
+        std::vector<TraceJob> lightJobs, cutJobs;
+        for (int j = 0; j < count; j++) {
+            (jobs[j].cut ? cutJobs : lightJobs).push_back(jobs[j]);
+        }
+        traceCuts(cutJobs.data(), (int)cutJobs.size());
+        std::vector<uint16_t> masks(lightJobs.size());
+        traceMasks(lightJobs.data(), (int)lightJobs.size(), false, masks.data());
+        for (size_t j = 0; j < lightJobs.size(); j++) {
+            const TraceJob& job = lightJobs[j];
+            visibility[job.chart][job.light][job.x + job.y * charts[job.chart].width] = masks[j];
+        }
+    }
+
+    // Adaptive AA, first pass: only the ray to the middle of the light.
+    // Area lights sample by their own rules and are left out, as are light
+    // cuts, whose neighbours needn't share them.
+    void TraceCenters(const TraceJob* jobs, int count)
+    {
+        std::vector<TraceJob> points;
+        for (int j = 0; j < count; j++) {
+            if (!jobs[j].cut && !IsAreaLight(lights[jobs[j].light])) {
+                points.push_back(jobs[j]);
+            }
+        }
+        std::vector<uint16_t> masks(points.size());
+        traceMasks(points.data(), (int)points.size(), true, masks.data());
+        for (size_t j = 0; j < points.size(); j++) {
+            const TraceJob& job = points[j];
+            centerVisibility[job.chart][job.light][job.x + job.y * charts[job.chart].width] = (uint8_t)masks[j];
+        }
+    }
+
+    // Adaptive AA, second pass: texels on a shadow edge get the full set of
+    // samples, every other texel takes its center ray's answer for all of
+    // them. Needs the center rays of the jobs' neighbours traced already.
+    // Area light jobs and light cuts are always traced in full.
+    void RefineJobs(const TraceJob* jobs, int count)
+    {
+        std::vector<TraceJob> edges;
+        const uint16_t all = (uint16_t)((1u << SampleCount()) - 1);
+        for (int j = 0; j < count; j++) {
+            const TraceJob& job = jobs[j];
+            if (job.cut || IsAreaLight(lights[job.light]) || IsShadowEdge(job.chart, job.x, job.y, job.light)) {
+                edges.push_back(job);
+            } else {
+                bool lit = centerVisibility[job.chart][job.light][job.x + job.y * charts[job.chart].width];
+                visibility[job.chart][job.light][job.x + job.y * charts[job.chart].width] = lit ? all : 0;
+            }
+        }
+        TraceJobs(edges.data(), (int)edges.size());
+    }
+
+    // Does any neighbour within the chart disagree with the texel's center ray
+    bool IsShadowEdge(int chart, int x, int y, int light) const
+    {
+        const std::vector<uint8_t>& centers = centerVisibility[chart][light];
+        int width = charts[chart].width;
+        int height = charts[chart].height;
+        uint8_t lit = centers[x + y * width];
+        return (x > 0 && centers[x - 1 + y * width] != lit) ||
+               (x < width - 1 && centers[x + 1 + y * width] != lit) ||
+               (y > 0 && centers[x + (y - 1) * width] != lit) ||
+               (y < height - 1 && centers[x + (y + 1) * width] != lit);
+    }
+
+    // Sums up a texel from its visibility bits, in light then sample order
+    float ResolveTexel(int chart, int x, int y) const
+    {
+        return sumTexel(chart, x, y, true);
+    }
+
+    // A texel as if nothing cast shadows: every sample in front of the face
+    // reaches its light. Costs no rays, the first look a progressive bake
+    // gives.
+    float CoarseTexel(int chart, int x, int y) const
+    {
+        return sumTexel(chart, x, y, false);
+    }
+
+    // Offset from a texel's ray origin to one of its AA sample points
+    void SampleOffset(const TexelOrigin& o, Int3 l, int aa, float& dx, float& dy) const
+    {
+        if (!AdaptiveAA()) {
+            CornerOffset(o, l, aa, dx, dy);
+            return;
+        }
+        // One jittered point per cell of a grid over the light's cell. The
+        // jitter only depends on the texel, light and sample, so every
+        // thread and every re-bake picks the same points.
+        int grid = AdaptiveGrid();
+        uint32_t seed = hashBits(o.x) ^ hashBits(o.z) * 3 ^ (uint32_t)o.layer * 5 ^
+                        (uint32_t)l.x * 7 ^ (uint32_t)l.z * 11 ^ (uint32_t)aa * 13;
+        uint32_t h = mixBits(seed);
+        float jitterX = (h & 0xffff) / 65536.0f;
+        float jitterY = (h >> 16) / 65536.0f;
+        dx = (l.x + ((aa % grid) + jitterX) / grid) - o.x;
+        dy = (l.z + ((aa / grid) + jitterY) / grid) - o.z;
+    }
+
+    // Offset from a texel's ray origin to one of the four corners of the light's cell
+    static void CornerOffset(const TexelOrigin& o, Int3 l, int aa, float& dx, float& dy)
+    {
+        float nudgeX = 0.5;
+        float nudgeY = 0.5;
+        switch (aa) {
+            case 0:
+                break;
+            case 1:
+                nudgeX *= -1.0;
+                break;
+            case 2:
+                nudgeY *= -1.0;
+                break;
+            case 3:
+                nudgeX *= -1.0;
+                nudgeY *= -1.0;
+                break;
+        }
+        dx = (l.x + 0.5f + nudgeX) - o.x;
+        dy = (l.z + 0.5f + nudgeY) - o.z;
+    }
+
+    // Offset from a texel's ray origin to the middle of the light's cell
+    static void CenterOffset(const TexelOrigin& o, Int3 l, float& dx, float& dy)
+    {
+        dx = (l.x + 0.5f) - o.x;
+        dy = (l.z + 0.5f) - o.z;
+    }
+
+    // Bins to the side of the texel's own that AA sample aa of count looks
+    // up in a polar map, spread evenly over [-polarFilter, polarFilter]
+    int PolarFilterOffset(int aa, int count) const
+    {
+        int filter = std::max(0, polarFilter);
+        return (2 * aa + 1) * (2 * filter + 1) / (2 * count) - filter;
+    }
+
+    // Walls only take light from in front of them
+    static bool FacesSample(const TexelOrigin& o, float dx, float dy)
+    {
+        if (o.wallAxis < 0) { return true; }
+        float target = o.wallAxis == 0 ? o.x + dx : o.z + dy;
+        return (target - o.plane) * o.sign > 0;
+    }
+
+    bool CheckIfInsideCube(Int3 pos) const
+    {
+        return occupancy.IsOccupied(pos);
+    }
+
+    // Walks from the origin towards the light in unit steps through grid layer y
+    bool IsOccludedMarch(float originX, float originY, int layer, float dx, float dy, float distance) const
+    {
+        const int maxSteps = 256;
+        float stepX = dx / distance;
+        float stepY = dy / distance;
+
+        float currentX = originX;
+        float currentY = originY;
+
+        for (int step = 0; step < std::min((int)distance, maxSteps); step++) {
+            int mapX = (int)currentX;
+            int mapY = (int)currentY;
+
+            if (CheckIfInsideCube(Int3{mapX,layer,mapY})) {
+                return true;
+            }
+
+            currentX += stepX;
+            currentY += stepY;
+        }
+        return false;
+    }
+
+    // Visits every cell between the origin and the light exactly once, with no step cap
+    bool IsOccludedDDA(float originX, float originY, int layer, float dx, float dy) const
+    {
+        return TraverseCells2D(originX, originY, dx, dy, [this, layer](int cellX, int cellY) {
+            return CheckIfInsideCube(Int3{cellX,layer,cellY});
+        });
+    }
+
+    // Is anything in the way between the origin and origin + (dx,dy) in grid layer y
+    bool IsOccluded(float originX, float originY, int layer, float dx, float dy, float distance) const
+    {
+        switch (visibilityMode) {
+            case VISIBILITY_DDA:
+                return IsOccludedDDA(originX, originY, layer, dx, dy);
+            case VISIBILITY_BVH:
+                return occluderBVH.AnyHit(Float3{originX,layer + 0.5f,originY}, Float3{dx,0.0f,dy});
+            case VISIBILITY_SDF:
+                return distanceField.Trace(occupancy, layer, originX, originY, dx, dy);
+            case VISIBILITY_POLAR:
+                // Only area lights get here, point lights look up their map
+                return IsOccludedDDA(originX, originY, layer, dx, dy);
+            case VISIBILITY_MARCH:
+            default:
+                return IsOccludedMarch(originX, originY, layer, dx, dy, distance);
+        }
+    }
+
+private:
+    std::unique_ptr<ThreadPool> pool;
+    SkylinePacker packer;
+    bool baked = false;
+    // GetCubeFace for every chart, rebuilt by SetScene
+    std::vector<CubeFace> faceFrames;
+    // Whether PrepareScene has run since SetScene
+    bool scenePrepared = false;
+    // bakeSettings() the stored visibility was traced with
+    uint64_t bakedSettings = 0;
+    // Mode polarMaps and distanceField were last built for
+    VisibilityMode mapsMode = VISIBILITY_DDA;
+    // lightCuts as chartLights and lightTree were last built for
+    bool lightsInTree = false;
+
+    // Progressive bake state: the pass running and the next tile it takes
+    enum ProgressPhase {
+        PROGRESS_IDLE,
+        PROGRESS_SCENE,   // occupancy grid, BVH, light tree and distance field
+        PROGRESS_MAPS,    // polar shadow maps, a batch of lights at a time
+        PROGRESS_CHARTS,  // lights and visibility bits of a batch of charts
+        PROGRESS_COARSE,  // unshadowed estimate
+        PROGRESS_CENTERS, // adaptive AA center rays
+        PROGRESS_TRACE,   // traced and resolved for good
+        PROGRESS_LINKS,   // radiosity links, a batch of face pairs at a time
+        PROGRESS_PATCHES, // patch trees laid out for the links
+        PROGRESS_DIRECT,  // direct light averaged over the patches
+        PROGRESS_BOUNCES, // one bounce at a time
+        PROGRESS_INDIRECT // bounced light added to the tiles
+    };
+    ProgressPhase progressPhase = PROGRESS_IDLE;
+    std::vector<BakeTile> progressTiles;
+    int progressNext = 0;
+    // Whether the scene steps rebuild the visibility maps and chart lights
+    bool progressMaps = false;
+    bool progressLights = false;
+    // Sources of the face being linked, and the next of them to link with
+    std::vector<int> progressSources;
+    int progressPair = 0;
+    // Direct light of every chart's texels while bounced light is added
+    std::vector<std::vector<float>> bounceDirect;
+
+    uint64_t bakeSettings() const
+    {
+        BakeHasher h;
+        h.Add((int32_t)visibilityMode);
+        h.Add((int32_t)(AdaptiveAA() ? AdaptiveGrid() : 0));
+        h.Add((int32_t)(visibilityMode == VISIBILITY_POLAR ? polarFilter : 0));
+        h.Add((int32_t)(visibilityMode == VISIBILITY_SDF && sdfSoftShadows));
+        float softness = visibilityMode == VISIBILITY_SDF && sdfSoftShadows ? sdfSoftness : 0.0f;
+        h.Add(&softness, sizeof(softness));
+        h.Add((int32_t)lightCuts);
+        float cutError = lightCuts ? lightCutError : 0.0f;
+        h.Add(&cutError, sizeof(cutError));
+        h.Add((int32_t)(lightCuts ? std::max(1, lightCutMaxSize) : 0));
+        h.Add(&areaSampleSpacing, sizeof(areaSampleSpacing));
+        // Untouched texels keep their bounced light, only right for the
+        // same solver settings
+        h.Add((int32_t)indirectBounces);
+        h.Add(&radiosity.albedo, sizeof(radiosity.albedo));
+        h.Add(&radiosity.epsilon, sizeof(radiosity.epsilon));
+        h.Add(&radiosity.minFormFactor, sizeof(radiosity.minFormFactor));
+        return h.value;
+    }
+
+    // Packs the atlas and clears everything traced, ahead of a full bake
+    void resetBake()
+    {
+        progressPhase = PROGRESS_IDLE;
+        progressTiles.clear();
+        baked = false;
+        PrepareScene();
+        PackCharts();
+        resetVisibilityCharts();
+        runParallel((int)charts.size(), [&](int chart) {
+            resetVisibility(chart);
+        });
+        samplesTraced = 0;
+        cutsCapped = 0;
+    }
+
+    // One entry per chart in every per-chart array, each emptied
+    void resetVisibilityCharts()
+    {
+        visibility.assign(charts.size(), std::vector<std::vector<uint16_t>>());
+        centerVisibility.assign(AdaptiveAA() ? charts.size() : 0, std::vector<std::vector<uint8_t>>());
+        chartCuts.assign(lightsInTree ? charts.size() : 0, std::vector<std::vector<LightCutEntry>>());
+    }
+
+    // Progressive bake: a slice of preparing the scene. The first step
+    // builds everything that can't be split, then the polar maps go a
+    // batch of lights at a time and the charts a batch at a time.
+    void stepScene(int batch)
+    {
+        if (progressPhase == PROGRESS_SCENE) {
+            progressMaps = !scenePrepared || mapsMode != visibilityMode;
+            progressLights = !scenePrepared || lightsInTree != lightCuts;
+            if (!scenePrepared) {
+                occupancy.Build(cubes);
+                occluderBVH.Build(cubes);
+            }
+            if (progressMaps) {
+                beginVisibilityMaps();
+            }
+            if (progressLights) {
+                beginLights();
+            }
+            resetVisibilityCharts();
+            progressNext = 0;
+            progressPhase = progressMaps && !polarMaps.empty() ? PROGRESS_MAPS : PROGRESS_CHARTS;
+            return;
+        }
+        if (progressPhase == PROGRESS_MAPS) {
+            int count = std::min(batch, (int)polarMaps.size() - progressNext);
+            runParallel(count, [&](int i) {
+                buildPolarMap(progressNext + i);
+            });
+            progressNext += count;
+            if (progressNext == (int)polarMaps.size()) {
+                progressNext = 0;
+                progressPhase = PROGRESS_CHARTS;
+            }
+            return;
+        }
+        // A chart takes a look at every light, so a few go to each worker
+        int count = std::min(batch * 16, (int)charts.size() - progressNext);
+        runParallel(count, [&](int i) {
+            int chart = progressNext + i;
+            if (progressLights) {
+                assignChart(chart);
+            }
+            resetVisibility(chart);
+        });
+        progressNext += count;
+        if (progressNext == (int)charts.size()) {
+            scenePrepared = true;
+            progressNext = 0;
+            progressPhase = PROGRESS_COARSE;
+        }
+    }
+
+    // Every texel/light pair of a tile within the light's radius
+    std::vector<TraceJob> tileJobs(const BakeTile& t) const
+    {
+        std::vector<TraceJob> jobs;
+        for (int y = t.y0; y < t.y1; y++) {
+            for (int x = t.x0; x < t.x1; x++) {
+                TexelOrigin o = GetTexelOrigin(t.chart, x, y);
+                for (int li : chartLights[t.chart]) {
+                    if (TexelInRange(o, lights[li])) {
+                        jobs.push_back(TraceJob{t.chart, x, y, li});
+                    }
+                }
+                if (lightsInTree) {
+                    jobs.push_back(TraceJob{t.chart, x, y, -1, true});
+                }
+            }
+        }
+        return jobs;
+    }
+
+    // Texels a tile writes, counting the padding writeTexel fills at the
+    // chart's edges
+    AtlasRect tileRect(const BakeTile& t) const
+    {
+        const LightMapChart& c = charts[t.chart];
+        int x0 = c.x + t.x0 - (t.x0 == 0 ? 1 : 0);
+        int y0 = c.y + t.y0 - (t.y0 == 0 ? 1 : 0);
+        int x1 = c.x + t.x1 + (t.x1 == c.width ? 1 : 0);
+        int y1 = c.y + t.y1 + (t.y1 == c.height ? 1 : 0);
+        return AtlasRect{x0, y0, x1 - x0, y1 - y0};
+    }
+
+    // ResolveTexel, or with shadowed unset CoarseTexel
+    float sumTexel(int chart, int x, int y, bool shadowed) const
+    {
+        int index = x + y * charts[chart].width;
+        int samples = SampleCount();
+        TexelOrigin o = GetTexelOrigin(chart, x, y);
+        float currentLightValue = 0.0;
+        // Area lights average over their own sample counts
+        float areaLightValue = 0.0f;
+        for (int li : chartLights[chart]) {
+            const PointLight& light = lights[li];
+            if (!TexelInRange(o, light)) { continue; }
+            if (IsAreaLight(light)) {
+                float dx[LIGHTMAP_MAX_SAMPLES], dy[LIGHTMAP_MAX_SAMPLES];
+                int count = sampleOffsets(o, li, false, dx, dy);
+                uint16_t lit = shadowed ? visibility[chart][li][index] : 0;
+                int reached = 0;
+                for (int aa = 0; aa < count; aa++) {
+                    if (shadowed ? (lit >> aa) & 1 : (dx[aa] * dx[aa] + dy[aa] * dy[aa] == 0 || FacesSample(o, dx[aa], dy[aa]))) {
+                        reached++;
+                    }
+                }
+                areaLightValue += LightFalloff(o.cornerX, o.cornerZ, light) * reached / count;
+                continue;
+            }
+            Int3 l = light.pos;
+            uint16_t lit = shadowed ? visibility[chart][li][index] : 0;
+            for (int aa = 0; aa < samples; aa++) {
+                float dx, dy;
+                SampleOffset(o, l, aa, dx, dy);
+                float distance = std::sqrt(dx * dx + dy * dy);
+
+                if (distance == 0) {
+                    currentLightValue += 1.0f;
+                    continue;
+                }
+
+                if (shadowed ? (lit >> aa) & 1 : FacesSample(o, dx, dy)) {
+                    currentLightValue += LightFalloff(o.cornerX, o.cornerZ, light);
+                }
+            }
+        }
+        // Light cut clusters count as that many copies of their
+        // representative. Unshadowed, the cut is picked on the spot.
+        float cutLightValue = 0.0f;
+        if (lightsInTree && shadowed) {
+            for (const LightCutEntry& e : chartCuts[chart][index]) {
+                cutLightValue += cutEntryLight(o, e.node, e.mask, true);
+            }
+        } else if (lightsInTree) {
+            std::vector<int> cut;
+            pickCut(o, cut);
+            for (int node : cut) {
+                cutLightValue += cutEntryLight(o, node, 0, false);
+            }
+        }
+        // Averaged over the AA samples
+        return currentLightValue/(double)samples + areaLightValue + cutLightValue;
+    }
+
+
+    // Offsets from a texel's ray origin to every sample it takes of a
+    // light: the one center ray, the point light's AA samples, or as many
+    // points of an area light as its width calls for. Returns how many.
+    int sampleOffsets(const TexelOrigin& o, int light, bool center, float* dx, float* dy) const
+    {
+        const PointLight& l = lights[light];
+        if (center) {
+            CenterOffset(o, l.pos, dx[0], dy[0]);
+            return 1;
+        }
+        if (IsAreaLight(l)) {
+            int count = AreaLightSampleCount(l, o.x, o.z, areaSampleSpacing);
+            // Same idea as the adaptive AA jitter: fixed per texel and light
+            uint32_t seed = hashBits(o.x) ^ hashBits(o.z) * 3 ^ (uint32_t)o.layer * 5 ^
+                            (uint32_t)l.pos.x * 7 ^ (uint32_t)l.pos.z * 11;
+            AreaLightOffsets(l, GetAreaLightFrame(l, mixBits(seed)), o.x, o.z, count, dx, dy, simdLevel);
+            return count;
+        }
+        int samples = SampleCount();
+        for (int aa = 0; aa < samples; aa++) {
+            SampleOffset(o, l.pos, aa, dx[aa], dy[aa]);
+        }
+        return samples;
+    }
+
+    // Traces the samples of every job, bit s of masks[j] set when sample s
+    // of job j reaches the light. With center set each job has the one ray
+    // to the middle of the light. With the DDA kernel and a SIMD level set,
+    // all rays of the batch are traced as packets.
+    void traceMasks(const TraceJob* jobs, int count, bool center, uint16_t* masks)
+    {
+        float dx[LIGHTMAP_MAX_SAMPLES], dy[LIGHTMAP_MAX_SAMPLES];
+        uint64_t traced = 0;
+
+        if (visibilityMode == VISIBILITY_DDA && simdLevel != SIMD_SCALAR) {
+            std::vector<CellWalk2D> walks;
+            std::vector<int> layers;
+            std::vector<uint8_t> blocked;
+            std::vector<TexelOrigin> origins(count);
+            walks.reserve(count * (center ? 1 : SampleCount()));
+            layers.reserve(walks.capacity());
+            for (int j = 0; j < count; j++) {
+                const TraceJob& job = jobs[j];
+                const TexelOrigin& o = origins[j] = GetTexelOrigin(job.chart, job.x, job.y);
+                int samples = sampleOffsets(o, job.light, center, dx, dy);
+                for (int aa = 0; aa < samples; aa++) {
+                    if (std::sqrt(dx[aa] * dx[aa] + dy[aa] * dy[aa]) != 0 && FacesSample(o, dx[aa], dy[aa])) {
+                        walks.push_back(BeginCellWalk2D(o.x, o.z, dx[aa], dy[aa]));
+                        layers.push_back(o.layer);
+                    }
+                }
+            }
+            blocked.resize(walks.size());
+            TracePacketDDA(occupancy, walks.data(), layers.data(), blocked.data(), (int)walks.size(), simdLevel);
+            traced = walks.size();
+
+            size_t ray = 0;
+            for (int j = 0; j < count; j++) {
+                const TraceJob& job = jobs[j];
+                const TexelOrigin& o = origins[j];
+                int samples = sampleOffsets(o, job.light, center, dx, dy);
+                uint16_t lit = 0;
+                for (int aa = 0; aa < samples; aa++) {
+                    if (std::sqrt(dx[aa] * dx[aa] + dy[aa] * dy[aa]) == 0) {
+                        lit |= 1 << aa;
+                    } else if (FacesSample(o, dx[aa], dy[aa]) && !blocked[ray++]) {
+                        lit |= 1 << aa;
+                    }
+                }
+                masks[j] = lit;
+            }
+        } else {
+            for (int j = 0; j < count; j++) {
+                const TraceJob& job = jobs[j];
+                TexelOrigin o = GetTexelOrigin(job.chart, job.x, job.y);
+                int samples = sampleOffsets(o, job.light, center, dx, dy);
+                if (visibilityMode == VISIBILITY_SDF && sdfSoftShadows && !IsAreaLight(lights[job.light])) {
+                    masks[j] = softShadowMask(o, job.light, samples, dx, dy);
+                    traced++;
+                    continue;
+                }
+                const PolarShadowMap* polar = polarMaps.empty() || polarMaps[job.light].bins == 0 ? nullptr : &polarMaps[job.light];
+                // Samples that look up the same bin share the answer
+                int lookedUp = INT_MIN;
+                bool visible = false;
+                uint16_t lit = 0;
+                for (int aa = 0; aa < samples; aa++) {
+                    float distance = std::sqrt(dx[aa] * dx[aa] + dy[aa] * dy[aa]);
+                    if (distance == 0) {
+                        lit |= 1 << aa;
+                        continue;
+                    }
+                    if (!FacesSample(o, dx[aa], dy[aa])) { continue; }
+                    if (polar) {
+                        int offset = center ? 0 : PolarFilterOffset(aa, samples);
+                        if (offset != lookedUp) {
+                            traced++;
+                            visible = polar->Visible(o.layer, o.x, o.z, offset);
+                            lookedUp = offset;
+                        }
+                        lit |= visible ? 1 << aa : 0;
+                        continue;
+                    }
+                    traced++;
+                    if (!IsOccluded(o.x, o.z, o.layer, dx[aa], dy[aa], distance)) {
+                        lit |= 1 << aa;
+                    }
+                }
+                masks[j] = lit;
+            }
+        }
+        samplesTraced += traced;
+    }
+
+    // SDF soft shadows: the texel's center ray says how lit it is, and that
+    // share of the samples facing the light get their bit, first ones first
+    uint16_t softShadowMask(const TexelOrigin& o, int light, int samples, const float* dx, const float* dy) const
+    {
+        uint16_t lit = 0;
+        int facing = 0;
+        for (int aa = 0; aa < samples; aa++) {
+            if (dx[aa] * dx[aa] + dy[aa] * dy[aa] == 0) {
+                lit |= 1 << aa;
+            } else if (FacesSample(o, dx[aa], dy[aa])) {
+                facing++;
+            }
+        }
+        if (facing == 0) { return lit; }
+        float toX, toZ, penumbra;
+        CenterOffset(o, lights[light].pos, toX, toZ);
+        distanceField.Trace(occupancy, o.layer, o.x, o.z, toX, toZ, sdfSoftness, &penumbra);
+        int reached = (int)std::lround(penumbra * facing);
+        for (int aa = 0; aa < samples && reached > 0; aa++) {
+            if (dx[aa] * dx[aa] + dy[aa] * dy[aa] != 0 && FacesSample(o, dx[aa], dy[aa])) {
+                lit |= 1 << aa;
+                reached--;
+            }
+        }
+        return lit;
+    }
+
+    static uint32_t hashBits(float v)
+    {
+        uint32_t bits;
+        memcpy(&bits, &v, sizeof(bits));
+        return bits;
+    }
+
+    static uint32_t mixBits(uint32_t h)
+    {
+        h ^= h >> 16;
+        h *= 0x7feb352du;
+        h ^= h >> 15;
+        h *= 0x846ca68bu;
+        h ^= h >> 16;
+        return h;
+    }
+
+    bool placeChart(int chart)
+    {
+        const int pad = LIGHTMAP_CHART_PADDING;
+        LightMapChart& c = charts[chart];
+        int x, y;
+        if (!packer.Insert(c.width + 2*pad, c.height + 2*pad, x, y)) {
+            return false;
+        }
+        c.x = x + pad;
+        c.y = y + pad;
+        return true;
+    }
+
+    // Hands every light to the charts it can reach, or with light cuts on,
+    // every point light to the light tree and the rest to the charts
+    void assignLights()
+    {
+        beginLights();
+        runParallel((int)faceFrames.size(), [&](int chart) {
+            assignChart(chart);
+        });
+    }
+
+    // Builds the light tree and leaves every chart without lights, for
+    // assignChart to fill in
+    void beginLights()
+    {
+        lightsInTree = lightCuts;
+        std::vector<int> treeLights;
+        for (int li = 0; li < (int)lights.size(); li++) {
+            if (InLightTree(li)) {
+                treeLights.push_back(li);
+            }
+        }
+        lightTree.Build(lights, treeLights);
+        chartLights.assign(faceFrames.size(), std::vector<int>());
+    }
+
+    void assignChart(int chart)
+    {
+        for (int li = 0; li < (int)lights.size(); li++) {
+            if (!InLightTree(li) && FaceInRange(faceFrames[chart], lights[li])) {
+                chartLights[chart].push_back(li);
+            }
+        }
+    }
+
+    // Light cuts: clears every texel's cut of a chart
+    void resetCuts(int chart)
+    {
+        chartCuts[chart].assign((size_t)charts[chart].width * charts[chart].height, std::vector<LightCutEntry>());
+    }
+
+    // Light cuts: the cut a texel starts from, picked on the light it would
+    // get if nothing cast shadows
+    void pickCut(const TexelOrigin& o, std::vector<int>& cut) const
+    {
+        lightTree.Cut(o.cornerX, o.cornerZ, lightCutError, std::max(1, lightCutMaxSize), [&](int light) {
+            return LightFalloff(o.cornerX, o.cornerZ, lights[light]);
+        }, cut);
+    }
+
+    // Light a cut node brings a texel, averaged over the AA samples, from
+    // the visibility bits of its representative, or with shadowed unset
+    // from every sample in front of the face
+    float cutEntryLight(const TexelOrigin& o, int node, uint16_t mask, bool shadowed) const
+    {
+        const LightTreeNode& n = lightTree.nodes[node];
+        const PointLight& light = lights[n.light];
+        if ((shadowed && mask == 0) || !TexelInRange(o, light)) { return 0.0f; }
+        float falloff = LightFalloff(o.cornerX, o.cornerZ, light);
+        int samples = SampleCount();
+        // Every sample lies within a cell of the light's, so one further
+        // off can't be right on the ray origin
+        if (shadowed && std::max(std::fabs(light.pos.x - o.x), std::fabs(light.pos.z - o.z)) > 2.0f) {
+            int lit = 0;
+            for (int aa = 0; aa < samples; aa++) {
+                lit += (mask >> aa) & 1;
+            }
+            return n.count * falloff * lit / samples;
+        }
+        float sum = 0.0f;
+        for (int aa = 0; aa < samples; aa++) {
+            float dx, dy;
+            SampleOffset(o, light.pos, aa, dx, dy);
+            if (dx * dx + dy * dy == 0) {
+                sum += 1.0f;
+            } else if (shadowed ? (mask >> aa) & 1 : FacesSample(o, dx, dy)) {
+                sum += falloff;
+            }
+        }
+        return n.count * sum / samples;
+    }
+
+    // Light cuts: picks and traces the cut of every job's texel. Each
+    // starts from pickCut with every cluster's representative traced. The
+    // light a cluster brings is then known to within what it could bring
+    // at most: a light in reach adds nothing when shadowed, and at most its
+    // falloff at the nearest point of the cluster's box when not, or 1 for
+    // a sample right on the ray origin, which boxes that close count
+    // instead. So while those bounds add up to more than lightCutError of
+    // the light the texel is sure to get (what the cut brings, less them),
+    // the clusters with the biggest bounds are split and the one new
+    // representative each traced; the other child has its parent's. The
+    // texels go in step, so each round's rays are traced together.
+    void traceCuts(const TraceJob* jobs, int count)
+    {
+        struct CutState {
+            TexelOrigin o;
+            float onOrigin;
+            std::vector<LightCutEntry>* entries;
+            // What each entry brings once traced, and its bound. Entries
+            // split away have node -1 until the end.
+            std::vector<float> light, bounds;
+            std::vector<int> pending;
+            float sure, slack;
+            int size;
+        };
+        auto add = [&](CutState& c, int node, uint16_t mask, bool traced) {
+            const LightTreeNode& n = lightTree.nodes[node];
+            float distance = LightTree::Distance(n, c.o.cornerX, c.o.cornerZ);
+            float reach = 1.0f - distance * n.minFalloff;
+            if (reach <= 0.0f) { return; }
+            int e = (int)c.entries->size();
+            c.entries->push_back(LightCutEntry{node, mask});
+            c.light.push_back(traced ? cutEntryLight(c.o, node, mask, true) : 0.0f);
+            c.bounds.push_back(n.left < 0 ? 0.0f : n.count * (distance <= c.onOrigin ? 1.0f : reach));
+            c.sure += c.light[e];
+            c.slack += c.bounds[e];
+            c.size++;
+            if (!traced) { c.pending.push_back(e); }
+        };
+        const int maxSize = std::max(1, lightCutMaxSize);
+
+        std::vector<CutState> cuts(count);
+        std::vector<int> start;
+        for (int j = 0; j < count; j++) {
+            CutState& c = cuts[j];
+            c.o = GetTexelOrigin(jobs[j].chart, jobs[j].x, jobs[j].y);
+            c.onOrigin = getDistance2D(c.o.x, c.o.z, c.o.cornerX, c.o.cornerZ) + 1.5f;
+            c.entries = &chartCuts[jobs[j].chart][jobs[j].x + jobs[j].y * charts[jobs[j].chart].width];
+            c.entries->clear();
+            c.sure = c.slack = 0.0f;
+            c.size = 0;
+            pickCut(c.o, start);
+            c.entries->reserve(start.size() * 2);
+            c.light.reserve(start.size() * 2);
+            c.bounds.reserve(start.size() * 2);
+            for (int node : start) {
+                add(c, node, 0, false);
+            }
+        }
+
+        std::vector<TraceJob> reps;
+        std::vector<uint16_t> masks;
+        std::vector<std::pair<float, int>> open;
+        std::vector<int> split;
+        for (;;) {
+            reps.clear();
+            for (int j = 0; j < count; j++) {
+                for (int e : cuts[j].pending) {
+                    int rep = lightTree.nodes[(*cuts[j].entries)[e].node].light;
+                    if (TexelInRange(cuts[j].o, lights[rep])) {
+                        reps.push_back(TraceJob{jobs[j].chart, jobs[j].x, jobs[j].y, rep});
+                    }
+                }
+            }
+            masks.resize(reps.size());
+            traceMasks(reps.data(), (int)reps.size(), false, masks.data());
+            size_t traced = 0;
+            bool splitAny = false;
+            for (int j = 0; j < count; j++) {
+                CutState& c = cuts[j];
+                std::vector<LightCutEntry>& entries = *c.entries;
+                for (int e : c.pending) {
+                    int rep = lightTree.nodes[entries[e].node].light;
+                    entries[e].mask = TexelInRange(c.o, lights[rep]) ? masks[traced++] : 0;
+                    c.light[e] = cutEntryLight(c.o, entries[e].node, entries[e].mask, true);
+                    c.sure += c.light[e];
+                }
+                c.pending.clear();
+
+                // Biggest bounds first, split while what's left unsplit is
+                // still too far off
+                open.clear();
+                for (int e = 0; e < (int)entries.size(); e++) {
+                    if (entries[e].node >= 0 && c.bounds[e] > 0.0f) {
+                        open.push_back(std::make_pair(c.bounds[e], e));
+                    }
+                }
+                std::sort(open.begin(), open.end(), std::greater<std::pair<float, int>>());
+                split.clear();
+                float left = c.slack;
+                int grown = c.size;
+                for (auto& o : open) {
+                    if (left <= lightCutError * (c.sure - left) || grown + 1 > maxSize) { break; }
+                    left -= o.first;
+                    grown++;
+                    split.push_back(o.second);
+                }
+                for (int e : split) {
+                    const LightTreeNode& n = lightTree.nodes[entries[e].node];
+                    uint16_t mask = entries[e].mask;
+                    c.sure -= c.light[e];
+                    c.slack -= c.bounds[e];
+                    c.size--;
+                    entries[e].node = -1;
+                    add(c, n.left, mask, lightTree.nodes[n.left].light == n.light);
+                    add(c, n.right, mask, lightTree.nodes[n.right].light == n.light);
+                }
+                splitAny = splitAny || !split.empty();
+            }
+            if (!splitAny) { break; }
+        }
+        uint64_t capped = 0;
+        for (CutState& c : cuts) {
+            capped += c.slack > lightCutError * (c.sure - c.slack);
+            std::vector<LightCutEntry>& entries = *c.entries;
+            entries.erase(std::remove_if(entries.begin(), entries.end(), [](const LightCutEntry& e) { return e.node < 0; }),
+                          entries.end());
+            entries.shrink_to_fit();
+        }
+        cutsCapped += capped;
+    }
+
+    void resetVisibility(int chart)
+    {
+        if (lightsInTree) {
+            resetCuts(chart);
+        }
+        size_t texels = (size_t)charts[chart].width * charts[chart].height;
+        visibility[chart].assign(lights.size(), std::vector<uint16_t>());
+        for (int li : chartLights[chart]) {
+            visibility[chart][li].assign(texels, 0);
+        }
+        if (AdaptiveAA()) {
+            centerVisibility[chart].assign(lights.size(), std::vector<uint8_t>());
+            for (int li : chartLights[chart]) {
+                centerVisibility[chart][li].assign(texels, 0);
+            }
+        }
+    }
+
+    // Stores a texel, copying edge texels out into the padding around the
+    // chart so linear filtering never blends in a neighbouring chart
+    void writeTexel(int chart, int x, int y, float value)
+    {
+        int width = charts[chart].width;
+        int height = charts[chart].height;
+        size_t index = TexelIndex(chart, x, y);
+        data[index] = value;
+        for (int oy = (y == 0 ? -1 : 0); oy <= (y == height-1 ? 1 : 0); oy++) {
+            for (int ox = (x == 0 ? -1 : 0); ox <= (x == width-1 ? 1 : 0); ox++) {
+                data[index + ox + (ptrdiff_t)oy * atlasWidth] = value;
+            }
+        }
+    }
+
+    // What the visibility mode looks up besides the occupancy grid and BVH:
+    // a shadow map for every point light in polar mode, the distance field
+    // in SDF mode. Built in parallel; cleared when the mode doesn't use them.
+    void buildVisibilityMaps()
+    {
+        beginVisibilityMaps();
+        runParallel((int)polarMaps.size(), [&](int li) {
+            buildPolarMap(li);
+        });
+    }
+
+    // Builds the distance field if the mode wants it, and leaves one empty
+    // polar map per light for buildPolarMap in polar mode
+    void beginVisibilityMaps()
+    {
+        mapsMode = visibilityMode;
+        polarMaps.clear();
+        distanceField.Clear();
+        if (visibilityMode == VISIBILITY_SDF) {
+            distanceField.Build(occupancy, [this](int count, const std::function<void(int)>& task) {
+                runParallel(count, task);
+            });
+        }
+        if (visibilityMode == VISIBILITY_POLAR) {
+            polarMaps.resize(lights.size(), PolarShadowMap{0.0f, 0.0f, 0, 0, 0, {}});
+        }
+    }
+
+    void buildPolarMap(int light)
+    {
+        if (!IsAreaLight(lights[light])) {
+            polarMaps[light].Build(cubes, lights[light]);
+        }
+    }
+
+    // Starts adding bounced light: hands the radiosity solver the faces and
+    // has it start linking them, afresh without dirty
+    void beginIndirect(const CubeBVH* dirty)
+    {
+        std::vector<RadiosityFace> faces(charts.size());
+        for (int chart = 0; chart < (int)charts.size(); chart++) {
+            faces[chart] = RadiosityFace{faceFrames[chart], charts[chart].width, charts[chart].height,
+                                         cubes[chart / CUBE_FACE_COUNT].occluder};
+        }
+        if (!dirty) {
+            radiosity.Clear();
+        }
+        radiosity.BeginLinks(faces, occluderBVH, dirty ? *dirty : CubeBVH());
+        bounceDirect.assign(charts.size(), std::vector<float>());
+    }
+
+    std::function<void(int, const std::function<void(int)>&)> radiosityParallel()
+    {
+        return [this](int count, const std::function<void(int)>& task) {
+            runParallel(count, task);
+        };
+    }
+
+    void setBounceDirect(int chart)
+    {
+        int width = charts[chart].width;
+        bounceDirect[chart].resize((size_t)width * charts[chart].height);
+        for (int y = 0; y < charts[chart].height; y++) {
+            for (int x = 0; x < width; x++) {
+                bounceDirect[chart][x + y * width] = ResolveTexel(chart, x, y);
+            }
+        }
+        radiosity.SetDirect(chart, bounceDirect[chart]);
+    }
+
+    void writeBounced(int chart, int x, int y)
+    {
+        writeTexel(chart, x, y, bounceDirect[chart][x + (size_t)y * charts[chart].width] + radiosity.Indirect(chart, x, y));
+    }
+
+    // One slice of the progressive bake's bounced light: links for a batch
+    // of face pairs, the patches of a batch of faces, the direct light of a
+    // batch of faces, one bounce, or a batch of tiles written out. Batches
+    // are one per worker, as in the tracing passes.
+    void stepIndirect(int batch, std::vector<AtlasRect>& rects)
+    {
+        int faces = radiosity.FaceCount();
+        int first = progressNext;
+        if (progressPhase == PROGRESS_LINKS) {
+            // A face can have many sources, so it goes a batch of pairs at
+            // a time
+            if (first < faces) {
+                if (progressPair == 0) {
+                    radiosity.SourcesOf(first, progressSources);
+                }
+                int count = std::min(batch, (int)progressSources.size() - progressPair);
+                radiosity.LinkPairs(first, progressSources.data() + progressPair, count, radiosityParallel());
+                progressPair += count;
+                if (progressPair < (int)progressSources.size()) { return; }
+                progressPair = 0;
+                progressNext++;
+                if (progressNext < faces) { return; }
+            }
+            radiosity.EndLinks();
+            progressPhase = PROGRESS_PATCHES;
+        } else if (progressPhase == PROGRESS_PATCHES) {
+            int count = std::min(batch, faces - first);
+            radiosity.PatchFaces(first, count);
+            progressNext += count;
+            if (progressNext < faces) { return; }
+            progressPhase = PROGRESS_DIRECT;
+        } else if (progressPhase == PROGRESS_DIRECT) {
+            int count = std::min(batch, faces - first);
+            runParallel(count, [&](int i) {
+                setBounceDirect(first + i);
+            });
+            progressNext += count;
+            if (progressNext < faces) { return; }
+            progressPhase = PROGRESS_BOUNCES;
+        } else if (progressPhase == PROGRESS_BOUNCES) {
+            radiosity.Bounce();
+            progressNext++;
+            if (progressNext < indirectBounces) { return; }
+            progressPhase = PROGRESS_INDIRECT;
+        } else {
+            int count = std::min(batch, (int)progressTiles.size() - first);
+            runParallel(count, [&](int i) {
+                const BakeTile& t = progressTiles[first + i];
+                for (int y = t.y0; y < t.y1; y++) {
+                    for (int x = t.x0; x < t.x1; x++) {
+                        writeBounced(t.chart, x, y);
+                    }
+                }
+            });
+            for (int i = first; i < first + count; i++) {
+                rects.push_back(tileRect(progressTiles[i]));
+                EncodeRect(rects.back());
+            }
+            progressNext += count;
+            if (progressNext < (int)progressTiles.size()) { return; }
+            bounceDirect.clear();
+            endProgressiveBake();
+            return;
+        }
+        progressNext = 0;
+    }
+
+    void endProgressiveBake()
+    {
+        progressPhase = PROGRESS_IDLE;
+        progressTiles.clear();
+        baked = true;
+        bakedSettings = bakeSettings();
+    }
+
+    void runParallel(int count, const std::function<void(int)>& task)
+    {
+        if (workers == 1) {
+            for (int i = 0; i < count; i++) {
+                task(i);
+            }
+            return;
+        }
+        if (!pool || (workers != 0 && pool->WorkerCount() != workers)) {
+            pool.reset(new ThreadPool(workers));
+        }
+        pool->ParallelFor(count, task);
+    }
+
+    static bool sameOccluder(const Cube& a, const Cube& b)
+    {
+        if (a.occluder != b.occluder) { return false; }
+        if (!a.occluder) { return true; }
+        Int3 aMin = MinInt3(a.cornerA, a.cornerB), aMax = MaxInt3(a.cornerA, a.cornerB);
+        Int3 bMin = MinInt3(b.cornerA, b.cornerB), bMax = MaxInt3(b.cornerA, b.cornerB);
+        return aMin.x == bMin.x && aMin.y == bMin.y && aMin.z == bMin.z &&
+               aMax.x == bMax.x && aMax.y == bMax.y && aMax.z == bMax.z;
+    }
+
+    // Would the cube's faces map onto their charts the same way
+    static bool sameCharts(const Cube& a, const Cube& b)
+    {
+        return a.cornerA.x == b.cornerA.x && a.cornerA.y == b.cornerA.y && a.cornerA.z == b.cornerA.z &&
+               a.cornerB.x == b.cornerB.x && a.cornerB.y == b.cornerB.y && a.cornerB.z == b.cornerB.z &&
+               a.occluder == b.occluder && a.emissive == b.emissive &&
+               a.faces == b.faces && a.lightMapScale == b.lightMapScale;
+    }
+
+    static Cube grownBox(const Cube& c)
+    {
+        Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+        Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+        return Cube{Int3{minCorner.x-1, minCorner.y-1, minCorner.z-1}, Int3{maxCorner.x+1, maxCorner.y+1, maxCorner.z+1}};
+    }
+
+    // Could any of the texel's samples towards the light pass over a dirty
+    // box. Every point light sample lands inside the light's cell, and a box
+    // grown by a cell can't fit between the rays to the cell's corners. Area
+    // light samples land inside the box around the shape, so the rays go to
+    // points at most a cell apart all the way round it. A polar map lookup
+    // depends on every occluder in its bin up to the texel, and a bin is at
+    // most POLAR_SHADOW_BIN_ARC wide there, so one ray from the light along
+    // each bin the texel filters over does. An SDF soft shadow depends on
+    // every occluder near enough the center ray to darken it.
+    bool samplesCross(const CubeBVH& dirty, const TexelOrigin& o, int light) const
+    {
+        if (dirty.nodes.empty()) { return false; }
+        const PointLight& l = lights[light];
+        Float3 origin{o.x, o.layer + 0.5f, o.z};
+        if (visibilityMode == VISIBILITY_SDF && sdfSoftShadows && !IsAreaLight(l)) {
+            // The penumbra reads the clearance of every cell on the center
+            // ray, and only clearances below distance / softness count
+            float dx, dy;
+            CenterOffset(o, l.pos, dx, dy);
+            float reach = std::sqrt(dx * dx + dy * dy) / std::max(sdfSoftness, 1e-3f) + DISTANCE_FIELD_CELL_SLACK;
+            for (auto& b : dirty.boxes) {
+                if (o.layer + 0.5f >= b.lo.y && o.layer + 0.5f <= b.hi.y &&
+                    SegmentBoxDistance2D(o.x, o.z, dx, dy, b.lo.x, b.lo.z, b.hi.x, b.hi.z) <= reach) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (!polarMaps.empty() && polarMaps[light].bins != 0) {
+            const PolarShadowMap& m = polarMaps[light];
+            float toX = o.x - m.centerX, toZ = o.z - m.centerZ;
+            int filter = std::max(0, polarFilter);
+            for (int k = -filter; k <= filter; k++) {
+                float angle = k * (6.28318531f / m.bins);
+                float c = std::cos(angle), s = std::sin(angle);
+                if (dirty.AnyHit(Float3{m.centerX, o.layer + 0.5f, m.centerZ},
+                                 Float3{toX * c - toZ * s, 0.0f, toX * s + toZ * c})) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        if (!IsAreaLight(l)) {
+            for (int aa = 0; aa < 4; aa++) {
+                float dx, dy;
+                CornerOffset(o, l.pos, aa, dx, dy);
+                if (dirty.AnyHit(origin, Float3{dx, 0.0f, dy})) {
+                    return true;
+                }
+            }
+            return false;
+        }
+        float x0 = AreaLightCenterX(l) - AreaLightHalfX(l), x1 = AreaLightCenterX(l) + AreaLightHalfX(l);
+        float z0 = AreaLightCenterZ(l) - AreaLightHalfZ(l), z1 = AreaLightCenterZ(l) + AreaLightHalfZ(l);
+        int stepsX = std::max(1, (int)std::ceil(x1 - x0));
+        int stepsZ = std::max(1, (int)std::ceil(z1 - z0));
+        for (int i = 0; i <= stepsX; i++) {
+            float x = x0 + (x1 - x0) * i / stepsX;
+            if (dirty.AnyHit(origin, Float3{x - o.x, 0.0f, z0 - o.z}) ||
+                dirty.AnyHit(origin, Float3{x - o.x, 0.0f, z1 - o.z})) {
+                return true;
+            }
+        }
+        for (int i = 0; i <= stepsZ; i++) {
+            float z = z0 + (z1 - z0) * i / stepsZ;
+            if (dirty.AnyHit(origin, Float3{x0 - o.x, 0.0f, z - o.z}) ||
+                dirty.AnyHit(origin, Float3{x1 - o.x, 0.0f, z - o.z})) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool sameLight(const PointLight& a, const PointLight& b)
+    {
+        return a.pos.x == b.pos.x && a.pos.y == b.pos.y && a.pos.z == b.pos.z &&
+               a.falloff == b.falloff && a.shape == b.shape &&
+               a.sizeX == b.sizeX && a.sizeZ == b.sizeZ;
+    }
+
+    static bool sameLights(const std::vector<PointLight>& a, const std::vector<PointLight>& b)
+    {
+        if (a.size() != b.size()) { return false; }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (!sameLight(a[i], b[i])) { return false; }
+        }
+        return true;
+    }
+
+    // Texture rows where data differs from before, merged into runs. Rows
+    // the atlas grew by always count as changed.
+    std::vector<RowSpan> changedRows(const std::vector<float>& before) const
+    {
+        std::vector<RowSpan> spans;
+        size_t width = atlasWidth;
+        for (int row = 0; row < atlasHeight; row++) {
+            bool changed = (row + 1) * width > before.size();
+            for (size_t x = 0; x < width && !changed; x++) {
+                changed = data[row*width + x] != before[row*width + x];
+            }
+            if (!changed) { continue; }
+            if (!spans.empty() && spans.back().first + spans.back().count == row) {
+                spans.back().count++;
+            } else {
+                spans.push_back(RowSpan{row, 1});
+            }
+        }
+        return spans;
+    }
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef LIGHTTREE_H
+#define LIGHTTREE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "structs.h"
+
+// Cluster of point lights. A leaf holds one light; an inner node the
+// lights of both children, which it stands for through one of them.
+struct LightTreeNode {
+    // Box around the positions of every light in it, in XZ
+    float loX, loZ, hiX, hiZ;
+    // Slowest falloff in it, so the furthest any of them reaches
+    float minFalloff;
+    int count;
+    // Light whose visibility and falloff stand in for the whole cluster
+    int light;
+    // Children, -1 on a leaf. The left child always follows its parent.
+    int left, right;
+};
+
+typedef struct LightTreeNode LightTreeNode;
+
+// Binary tree of lights for lightcuts: each texel picks a cut through the
+// tree, a set of clusters that between them hold every light, and treats
+// each cluster as count copies of its representative light. Cut picks one
+// from the unshadowed falloff alone; how far it has to be split once
+// shadows are known is up to the caller, which has the rays.
+class LightTree
+{
+public:
+    std::vector<LightTreeNode> nodes;
+
+    // Builds the tree over lights[i] for every i in members, splitting at
+    // the median of the longer side of the box around them
+    void Build(const std::vector<PointLight>& lights, std::vector<int> members)
+    {
+        nodes.clear();
+        if (members.empty()) { return; }
+        nodes.reserve(members.size() * 2 - 1);
+        buildNode(lights, members, 0, (int)members.size());
+    }
+
+    // Nearest any light of a node can be to (x, z)
+    static float Distance(const LightTreeNode& n, float x, float z)
+    {
+        float outX = std::max(std::max(n.loX - x, x - n.hiX), 0.0f);
+        float outZ = std::max(std::max(n.loZ - z, z - n.hiZ), 0.0f);
+        return std::sqrt(outX * outX + outZ * outZ);
+    }
+
+    // Most the lights in a node can add up to at (x, z): each gives at most
+    // 1 - distance * falloff, and none is nearer than the node's box
+    static float Bound(const LightTreeNode& n, float x, float z)
+    {
+        float reach = 1.0f - Distance(n, x, z) * n.minFalloff;
+        return reach > 0.0f ? n.count * reach : 0.0f;
+    }
+
+    // Cut for a point at (x, z), as node indices in the order they were
+    // settled. falloff(light) is what one light adds there unshadowed.
+    // Nodes that can't reach the point are left out altogether. Splits the
+    // cluster with the biggest bound until the bounds of those left add up
+    // to within error of what the cut is sure to bring (its estimate less
+    // them), or until the cut holds maxSize nodes.
+    template <typename Falloff>
+    void Cut(float x, float z, float error, int maxSize, Falloff falloff, std::vector<int>& cut) const
+    {
+        cut.clear();
+        if (nodes.empty()) { return; }
+        // Clusters that may still split, biggest bound on top, with what
+        // one of their lights adds so a child with the same representative
+        // needn't work it out again
+        struct Open {
+            float bound;
+            int node;
+            float light;
+            bool operator<(const Open& o) const { return bound < o.bound; }
+        };
+        std::vector<Open> open;
+        float estimate = 0.0f, slack = 0.0f;
+        int size = 0;
+        auto add = [&](int node, int parentLight, float parentValue) {
+            const LightTreeNode& n = nodes[node];
+            float bound = Bound(n, x, z);
+            if (bound <= 0.0f) { return; }
+            float value = n.light == parentLight ? parentValue : std::max(0.0f, falloff(n.light));
+            estimate += n.count * value;
+            size++;
+            if (n.left < 0) {
+                cut.push_back(node);
+            } else {
+                slack += bound;
+                open.push_back(Open{bound, node, value});
+                std::push_heap(open.begin(), open.end());
+            }
+        };
+        add(0, -1, 0.0f);
+        while (!open.empty()) {
+            const Open top = open.front();
+            if (slack <= error * (estimate - slack) || size + 1 > maxSize) { break; }
+            std::pop_heap(open.begin(), open.end());
+            open.pop_back();
+            const LightTreeNode& n = nodes[top.node];
+            estimate -= n.count * top.light;
+            slack -= top.bound;
+            size--;
+            add(n.left, n.light, top.light);
+            add(n.right, n.light, top.light);
+        }
+        for (auto& o : open) {
+            cut.push_back(o.node);
+        }
+    }
+
+private:
+    int buildNode(const std::vector<PointLight>& lights, std::vector<int>& members, int first, int last)
+    {
+        int index = (int)nodes.size();
+        nodes.push_back(LightTreeNode{0, 0, 0, 0, 0, last - first, -1, -1, -1});
+        LightTreeNode n = nodes[index];
+        n.loX = n.hiX = (float)lights[members[first]].pos.x;
+        n.loZ = n.hiZ = (float)lights[members[first]].pos.z;
+        n.minFalloff = lights[members[first]].falloff;
+        for (int i = first + 1; i < last; i++) {
+            const PointLight& l = lights[members[i]];
+            n.loX = std::min(n.loX, (float)l.pos.x);
+            n.hiX = std::max(n.hiX, (float)l.pos.x);
+            n.loZ = std::min(n.loZ, (float)l.pos.z);
+            n.hiZ = std::max(n.hiZ, (float)l.pos.z);
+            n.minFalloff = std::min(n.minFalloff, l.falloff);
+        }
+        n.minFalloff = std::max(n.minFalloff, 0.0f);
+
+        if (last - first == 1) {
+            n.light = members[first];
+            nodes[index] = n;
+            return index;
+        }
+        bool alongX = n.hiX - n.loX >= n.hiZ - n.loZ;
+        int middle = (first + last) / 2;
+        // Ties broken on the index, so the same lights always split the same way
+        std::nth_element(members.begin() + first, members.begin() + middle, members.begin() + last, [&](int a, int b) {
+            int ka = alongX ? lights[a].pos.x : lights[a].pos.z;
+            int kb = alongX ? lights[b].pos.x : lights[b].pos.z;
+            return ka != kb ? ka < kb : a < b;
+        });
+        n.left = buildNode(lights, members, first, middle);
+        n.right = buildNode(lights, members, middle, last);
+
+        // Stand-in picked from a child in proportion to the lights in it,
+        // with a hash of the two so re-bakes pick the same one
+        const LightTreeNode& l = nodes[n.left];
+        const LightTreeNode& r = nodes[n.right];
+        uint32_t h = (uint32_t)l.light * 0x9e3779b1u ^ (uint32_t)r.light * 0x85ebca77u;
+        h ^= h >> 15;
+        h *= 0x2c1b3c6du;
+        h ^= h >> 12;
+        n.light = (h % (uint32_t)n.count) < (uint32_t)l.count ? l.light : r.light;
+        nodes[index] = n;
+        return index;
+    }
+};
+
+#endif
@@ -0,0 +1,544 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "structs.h"
+#include "constants.h"
+
+#define CUBE_FACE_COUNT 6
+
+// Unit cube, 6 vertices (x, y, z, u, v) per face. -0.5 and 0.5 stand for
+// cornerA and cornerB of the cube being built.
+const float cubeVertices[] = {
+    -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
+     0.5f, -0.5f, -0.5f,  1.0f, 0.0f,
+     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
+
+    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
+     0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
+    -0.5f,  0.5f,  0.5f,  0.0f, 1.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+
+    -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+    -0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+    -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+
+     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+     0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+
+    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+     0.5f, -0.5f, -0.5f,  1.0f, 1.0f,
+     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
+    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
+    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
+
+    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
+     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
+     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
+    -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
+    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
+};
+
+// FACE_* flag of each face of cubeVertices, in order
+const uint8_t cubeFaceFlags[CUBE_FACE_COUNT] = {
+    FACE_NORTH, // -z
+    FACE_SOUTH, // +z
+    FACE_WEST,  // -x
+    FACE_EAST,  // +x
+    FACE_BOTTOM,// -y
+    FACE_TOP    // +y
+};
+
+// cubeVertices with the repeats taken out: faces share the corners where
+// their texture coordinates agree, which leaves 16 distinct vertices
+struct CubeIndexTemplate {
+    int vertexCount;
+    float vertices[36 * 5];
+    // Each of the 36 cubeVertices as an index into vertices
+    uint8_t indices[36];
+};
+
+typedef struct CubeIndexTemplate CubeIndexTemplate;
+
+inline const CubeIndexTemplate& GetCubeIndexTemplate()
+{
+    static const CubeIndexTemplate t = [] {
+        CubeIndexTemplate r = {};
+        for (int i = 0; i < 36; i++) {
+            const float* vert = cubeVertices + i * 5;
+            int k = 0;
+            while (k < r.vertexCount && !std::equal(vert, vert + 5, r.vertices + k * 5)) { k++; }
+            if (k == r.vertexCount) {
+                std::copy(vert, vert + 5, r.vertices + k * 5);
+                r.vertexCount++;
+            }
+            r.indices[i] = (uint8_t)k;
+        }
+        return r;
+    }();
+    return t;
+}
+
+// World position a cubeVertices coordinate ends up at for this cube
+inline float CubeVertexCoord(const Cube& c, int axis, float v)
+{
+    const int a[3] = {c.cornerA.x, c.cornerA.y, c.cornerA.z};
+    const int b[3] = {c.cornerB.x, c.cornerB.y, c.cornerB.z};
+    if (v < -0.1f) { return (float)a[axis]; }
+    if (v > 0.1f) { return (float)b[axis]; }
+    return v;
+}
+
+// One face of a built cube. The face covers origin + s*u + t*v for s, t in
+// [0,1], where (s,t) is the texture coordinate the mesh gives that point.
+struct CubeFace {
+    float origin[3], u[3], v[3];
+    // Axis the face is perpendicular to, the side it faces and where it sits
+    int axis;
+    int sign;
+    float plane;
+};
+
+typedef struct CubeFace CubeFace;
+
+inline CubeFace GetCubeFace(const Cube& c, int face)
+{
+    const float* verts = cubeVertices + face * 6 * 5;
+    float p[4][3] = {};
+    bool found[4] = {};
+    // Vertices at texture coordinates (0,0), (1,0) and (0,1)
+    for (int i = 0; i < 6; i++) {
+        const float* vert = verts + i * 5;
+        int corner = (vert[3] > 0.5f) + 2 * (vert[4] > 0.5f);
+        for (int axis = 0; axis < 3; axis++) {
+            p[corner][axis] = CubeVertexCoord(c, axis, vert[axis]);
+        }
+        found[corner] = true;
+    }
+
+    CubeFace f;
+    for (int axis = 0; axis < 3; axis++) {
+        f.origin[axis] = p[0][axis];
+        f.u[axis] = found[1] ? p[1][axis] - p[0][axis] : 0.0f;
+        f.v[axis] = found[2] ? p[2][axis] - p[0][axis] : 0.0f;
+    }
+
+    // Faces come in -x/+x style pairs, the constant template coordinate says which
+    f.axis = face < 2 ? 2 : (face < 4 ? 0 : 1);
+    float side = verts[f.axis];
+    const int a[3] = {c.cornerA.x, c.cornerA.y, c.cornerA.z};
+    const int b[3] = {c.cornerB.x, c.cornerB.y, c.cornerB.z};
+    // A cube built with cornerA past cornerB is mirrored on that axis
+    int flip = b[f.axis] < a[f.axis] ? -1 : 1;
+    f.sign = (side > 0.0f ? 1 : -1) * flip;
+    f.plane = CubeVertexCoord(c, f.axis, side);
+    return f;
+}
+
+// Box a cube is drawn as, from its min corner to its max corner
+inline void CubeBounds(const Cube& c, float lo[3], float hi[3])
+{
+    Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+    Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+    lo[0] = (float)minCorner.x; lo[1] = (float)minCorner.y; lo[2] = (float)minCorner.z;
+    hi[0] = (float)maxCorner.x; hi[1] = (float)maxCorner.y; hi[2] = (float)maxCorner.z;
+}
+
+// Part of a face still showing, over the two axes in its plane
+struct FaceRect {
+    float lo[2], hi[2];
+};
+
+typedef struct FaceRect FaceRect;
+
+// Whether cube j, spanning boxLo to boxHi, covers the part of a face of cube
+// i it overlaps, by the rules of FaceUncovered
+inline bool CoversFace(const CubeFace& face, int i, int j, const float boxLo[3], const float boxHi[3])
+{
+    if (face.plane < boxLo[face.axis] || face.plane > boxHi[face.axis]) { return false; }
+    bool solidOutside = face.sign > 0 ? face.plane < boxHi[face.axis] : face.plane > boxLo[face.axis];
+    return solidOutside || j < i;
+}
+
+// What's left of face f of cube i with the parts the cubes in others cover
+// clipped away, as rectangles over the face's two in-plane axes (x before
+// y before z). A cube covers the part of the face it overlaps if it's
+// solid just outside the face, or if its own face lies on top of this one
+// (flat cubes included) and it comes first, so one of two coinciding faces
+// is always kept. Each covering cube cuts what's left into the rectangles
+// around it, so several cubes can cover a face between them.
+inline void FaceUncovered(const std::vector<Cube>& cubes, int i, int f, const std::vector<int>& others,
+                          std::vector<FaceRect>& open)
+{
+    CubeFace face = GetCubeFace(cubes[i], f);
+    const int a = face.axis == 0 ? 1 : 0;
+    const int b = face.axis == 2 ? 1 : 2;
+    float lo[3], hi[3];
+    CubeBounds(cubes[i], lo, hi);
+    open.clear();
+    if (hi[a] > lo[a] && hi[b] > lo[b]) {
+        open.push_back(FaceRect{{lo[a], lo[b]}, {hi[a], hi[b]}});
+    }
+    std::vector<FaceRect> left;
+    for (int j : others) {
+        if (open.empty()) { break; }
+        if (j == i) { continue; }
+        float boxLo[3], boxHi[3];
+        CubeBounds(cubes[j], boxLo, boxHi);
+        if (!CoversFace(face, i, j, boxLo, boxHi)) { continue; }
+
+        const float cutLo[2] = {boxLo[a], boxLo[b]};
+        const float cutHi[2] = {boxHi[a], boxHi[b]};
+        left.clear();
+        for (const FaceRect& r : open) {
+            if (cutLo[0] >= r.hi[0] || cutHi[0] <= r.lo[0] || cutLo[1] >= r.hi[1] || cutHi[1] <= r.lo[1]) {
+                left.push_back(r);
+                continue;
+            }
+            // Strips either side along the first axis, then what's above
+            // and below the cut between them
+            float midLo = std::max(r.lo[0], cutLo[0]), midHi = std::min(r.hi[0], cutHi[0]);
+            if (r.lo[0] < cutLo[0]) { left.push_back(FaceRect{{r.lo[0], r.lo[1]}, {cutLo[0], r.hi[1]}}); }
+            if (r.hi[0] > cutHi[0]) { left.push_back(FaceRect{{cutHi[0], r.lo[1]}, {r.hi[0], r.hi[1]}}); }
+            if (r.lo[1] < cutLo[1]) { left.push_back(FaceRect{{midLo, r.lo[1]}, {midHi, cutLo[1]}}); }
+            if (r.hi[1] > cutHi[1]) { left.push_back(FaceRect{{midLo, cutHi[1]}, {midHi, r.hi[1]}}); }
+        }
+        open.swap(left);
+    }
+}
+
+inline bool FaceCovered(const std::vector<Cube>& cubes, int i, int f, const std::vector<int>& others)
+{
+    // Covering cubes that overlap less than the face's area between them
+    // leave some of it showing. Settles big faces, like a floor with the
+    // whole level on it, without cutting them into thousands of pieces.
+    CubeFace face = GetCubeFace(cubes[i], f);
+    const int a = face.axis == 0 ? 1 : 0;
+    const int b = face.axis == 2 ? 1 : 2;
+    float lo[3], hi[3];
+    CubeBounds(cubes[i], lo, hi);
+    double area = (double)(hi[a] - lo[a]) * (hi[b] - lo[b]);
+    double overlap = 0.0;
+    for (int j : others) {
+        if (j == i) { continue; }
+        float boxLo[3], boxHi[3];
+        CubeBounds(cubes[j], boxLo, boxHi);
+        if (!CoversFace(face, i, j, boxLo, boxHi)) { continue; }
+        double width = std::min(hi[a], boxHi[a]) - std::max(lo[a], boxLo[a]);
+        double height = std::min(hi[b], boxHi[b]) - std::max(lo[b], boxLo[b]);
+        if (width > 0.0 && height > 0.0) {
+            overlap += width * height;
+        }
+    }
+    if (overlap < area) { return false; }
+
+    std::vector<FaceRect> open;
+    FaceUncovered(cubes, i, f, others, open);
+    return open.empty();
+}
+
+// Calls visit(i, f, others) for every face f of every cube i that isn't
+// masked out, with others the cubes that could touch it, in order. Cubes
+// are bucketed on a coarse XZ grid first, so a face only gets the cubes
+// around it.
+template <typename Visit>
+void ForEachFaceNeighbours(const std::vector<Cube>& cubes, Visit visit)
+{
+    if (cubes.empty()) { return; }
+
+    Int3 sceneLo = MinInt3(cubes[0].cornerA, cubes[0].cornerB);
+    Int3 sceneHi = MaxInt3(cubes[0].cornerA, cubes[0].cornerB);
+    for (const Cube& c : cubes) {
+        sceneLo = MinInt3(sceneLo, MinInt3(c.cornerA, c.cornerB));
+        sceneHi = MaxInt3(sceneHi, MaxInt3(c.cornerA, c.cornerB));
+    }
+    // Around one bucket per cube
+    double area = (double)(sceneHi.x - sceneLo.x + 1) * (sceneHi.z - sceneLo.z + 1);
+    int cell = std::max(1, (int)std::ceil(std::sqrt(area / cubes.size())));
+    int width = (sceneHi.x - sceneLo.x) / cell + 1;
+    int depth = (sceneHi.z - sceneLo.z) / cell + 1;
+    std::vector<std::vector<int>> buckets((size_t)width * depth);
+    // Buckets the XZ range [lo, hi] overlaps, inclusive
+    auto span = [&](const float lo[3], const float hi[3], int& x0, int& z0, int& x1, int& z1) {
+        x0 = ((int)lo[0] - sceneLo.x) / cell;
+        z0 = ((int)lo[2] - sceneLo.z) / cell;
+        x1 = ((int)hi[0] - sceneLo.x) / cell;
+        z1 = ((int)hi[2] - sceneLo.z) / cell;
+    };
+    for (int i = 0; i < (int)cubes.size(); i++) {
+        float lo[3], hi[3];
+        CubeBounds(cubes[i], lo, hi);
+        int x0, z0, x1, z1;
+        span(lo, hi, x0, z0, x1, z1);
+        for (int z = z0; z <= z1; z++) {
+            for (int x = x0; x <= x1; x++) {
+                buckets[(size_t)z * width + x].push_back(i);
+            }
+        }
+    }
+
+    std::vector<int> others;
+    for (int i = 0; i < (int)cubes.size(); i++) {
+        for (int f = 0; f < CUBE_FACE_COUNT; f++) {
+            if (!(cubes[i].faces & cubeFaceFlags[f])) { continue; }
+            CubeFace face = GetCubeFace(cubes[i], f);
+            float lo[3], hi[3];
+            for (int axis = 0; axis < 3; axis++) {
+                lo[axis] = face.origin[axis] + std::min(0.0f, face.u[axis]) + std::min(0.0f, face.v[axis]);
+                hi[axis] = face.origin[axis] + std::max(0.0f, face.u[axis]) + std::max(0.0f, face.v[axis]);
+            }
+            int x0, z0, x1, z1;
+            span(lo, hi, x0, z0, x1, z1);
+            others.clear();
+            for (int z = z0; z <= z1; z++) {
+                for (int x = x0; x <= x1; x++) {
+                    const std::vector<int>& bucket = buckets[(size_t)z * width + x];
+                    others.insert(others.end(), bucket.begin(), bucket.end());
+                }
+            }
+            // In order, so coinciding faces are settled the same way every time
+            std::sort(others.begin(), others.end());
+            others.erase(std::unique(others.begin(), others.end()), others.end());
+            visit(i, f, others);
+        }
+    }
+}
+
+// FACE_* flags of the faces of each cube that are drawn and can be seen:
+// not masked out, not flat and not covered by other cubes
+inline std::vector<uint8_t> ExposedFaces(const std::vector<Cube>& cubes)
+{
+    std::vector<uint8_t> exposed(cubes.size(), 0);
+    ForEachFaceNeighbours(cubes, [&](int i, int f, const std::vector<int>& others) {
+        if (!FaceCovered(cubes, i, f, others)) {
+            exposed[i] |= cubeFaceFlags[f];
+        }
+    });
+    return exposed;
+}
+
+// Indices of some of a LevelMesh's triangles
+struct MeshRange {
+    uint32_t first;
+    uint32_t count;
+};
+
+typedef struct MeshRange MeshRange;
+
+// The exposed faces of every cube of a level as one indexed triangle list,
+// vertices laid out like cubeVertices (x, y, z, u, v). Faces that sample
+// the lightmap are grouped by chart, so each is one draw with its own
+// LightMapRect; everything emissive is one draw at the end.
+struct LevelMesh {
+    // Only filled in by BuildLevelMesh and BuildGreedyLevelMesh; a
+    // streamed build leaves them empty
+    std::vector<float> vertices;
+    std::vector<uint32_t> indices;
+    size_t vertexCount = 0;
+    size_t indexCount = 0;
+    // Triangles of face f of cube c at c * CUBE_FACE_COUNT + f, empty for
+    // a face that isn't drawn or is emissive
+    std::vector<MeshRange> faces;
+    MeshRange emissive{0, 0};
+};
+
+typedef struct LevelMesh LevelMesh;
+
+// Where a streamed level mesh build sends the mesh: allocate gets the
+// sizes before anything else, then the writes come a batch at a time,
+// each with where in the whole mesh it goes (in vertices or indices)
+struct LevelMeshOutput {
+    std::function<void(size_t vertexCount, size_t indexCount)> allocate;
+    std::function<void(size_t first, const float* vertices, size_t count)> writeVertices;
+    std::function<void(size_t first, const uint32_t* indices, size_t count)> writeIndices;
+};
+
+typedef struct LevelMeshOutput LevelMeshOutput;
+
+// Output into the mesh's own vertices and indices
+inline LevelMeshOutput LevelMeshVectorOutput(LevelMesh& mesh)
+{
+    LevelMeshOutput out;
+    out.allocate = [&mesh](size_t vertexCount, size_t indexCount) {
+        mesh.vertices.assign(vertexCount * 5, 0.0f);
+        mesh.indices.assign(indexCount, 0);
+    };
+    out.writeVertices = [&mesh](size_t first, const float* vertices, size_t count) {
+        std::copy(vertices, vertices + count * 5, mesh.vertices.begin() + first * 5);
+    };
+    out.writeIndices = [&mesh](size_t first, const uint32_t* indices, size_t count) {
+        std::copy(indices, indices + count, mesh.indices.begin() + first);
+    };
+    return out;
+}
+
+// Holds vertices and indices on their way to a LevelMeshOutput, in batches
+// of fixed size, so a build never has more of the mesh than that in hand.
+// Vertices are written in the order they're added. Indices go into
+// streams that each carry on from their own start, so the lit and the
+// emissive triangles can be built side by side.
+class LevelMeshBatcher
+{
+public:
+    LevelMeshBatcher(const LevelMeshOutput& out, const std::vector<size_t>& streamStarts)
+        : out(out)
+    {
+        vertices.reserve(LEVEL_MESH_BATCH_VERTICES * 5);
+        for (size_t start : streamStarts) {
+            streams.push_back(IndexStream{start, std::vector<uint32_t>()});
+            streams.back().batch.reserve(LEVEL_MESH_BATCH_INDICES);
+        }
+    }
+
+    uint32_t AddVertex(const float* vertex)
+    {
+        if (vertices.size() == LEVEL_MESH_BATCH_VERTICES * 5) { flushVertices(); }
+        vertices.insert(vertices.end(), vertex, vertex + 5);
+        return (uint32_t)(vertexNext + vertices.size() / 5 - 1);
+    }
+
+    void AddIndex(int stream, uint32_t index)
+    {
+        IndexStream& s = streams[stream];
+        if (s.batch.size() == LEVEL_MESH_BATCH_INDICES) { flushIndices(s); }
+        s.batch.push_back(index);
+    }
+
+    // Hands over whatever is still held
+    void Flush()
+    {
+        flushVertices();
+        for (IndexStream& s : streams) {
+            flushIndices(s);
+        }
+    }
+
+private:
+    struct IndexStream {
+        size_t next;
+        std::vector<uint32_t> batch;
+    };
+
+    const LevelMeshOutput& out;
+    std::vector<float> vertices;
+    size_t vertexNext = 0;
+    std::vector<IndexStream> streams;
+
+    void flushVertices()
+    {
+        if (vertices.empty()) { return; }
+        out.writeVertices(vertexNext, vertices.data(), vertices.size() / 5);
+        vertexNext += vertices.size() / 5;
+        vertices.clear();
+    }
+
+    void flushIndices(IndexStream& s)
+    {
+        if (s.batch.empty()) { return; }
+        out.writeIndices(s.next, s.batch.data(), s.batch.size());
+        s.next += s.batch.size();
+        s.batch.clear();
+    }
+};
+
+// Adds the sizes of what StreamCubeFaces streams for the faces in drawn
+// to the counts, and gives each lit face its range, counting on from
+// litCount
+inline void CountCubeFaces(const std::vector<Cube>& cubes, const std::vector<uint8_t>& drawn, LevelMesh& mesh,
+                           size_t& vertexCount, size_t& litCount, size_t& emissiveCount)
+{
+    const CubeIndexTemplate& t = GetCubeIndexTemplate();
+    for (size_t ci = 0; ci < cubes.size(); ci++) {
+        bool used[36] = {};
+        for (int f = 0; f < CUBE_FACE_COUNT; f++) {
+            if (!(drawn[ci] & cubeFaceFlags[f])) { continue; }
+            for (int i = f * 6; i < f * 6 + 6; i++) {
+                used[t.indices[i]] = true;
+            }
+            if (cubes[ci].emissive) {
+                emissiveCount += 6;
+            } else {
+                mesh.faces[ci * CUBE_FACE_COUNT + f] = MeshRange{(uint32_t)litCount, 6};
+                litCount += 6;
+            }
+        }
+        vertexCount += std::count(used, used + 36, true);
+    }
+}
+
+// One quad per face in drawn, each cube's faces sharing the corners they
+// have in common. Lit triangles go to the batch's stream 0 and emissive
+// ones to stream 1, in the order CountCubeFaces counted them.
+inline void StreamCubeFaces(const std::vector<Cube>& cubes, const std::vector<uint8_t>& drawn, LevelMeshBatcher& batch)
+{
+    const CubeIndexTemplate& t = GetCubeIndexTemplate();
+    for (size_t ci = 0; ci < cubes.size(); ci++) {
+        const Cube& c = cubes[ci];
+        // Where each template vertex went in this cube, once it's used
+        int64_t placed[36];
+        std::fill(placed, placed + 36, -1);
+        for (int f = 0; f < CUBE_FACE_COUNT; f++) {
+            if (!(drawn[ci] & cubeFaceFlags[f])) { continue; }
+            for (int i = f * 6; i < f * 6 + 6; i++) {
+                int k = t.indices[i];
+                if (placed[k] < 0) {
+                    const float* vert = t.vertices + k * 5;
+                    float v[5];
+                    for (int axis = 0; axis < 3; axis++) {
+                        v[axis] = CubeVertexCoord(c, axis, vert[axis]);
+                    }
+                    v[3] = vert[3];
+                    v[4] = vert[4];
+                    placed[k] = batch.AddVertex(v);
+                }
+                batch.AddIndex(c.emissive ? 1 : 0, (uint32_t)placed[k]);
+            }
+        }
+    }
+}
+
+// One quad per exposed face. Counts the mesh first so out can be
+// allocated, then streams it through a LevelMeshBatcher; mesh gets the
+// sizes and ranges.
+inline void StreamLevelMesh(const std::vector<Cube>& cubes, LevelMesh& mesh, const LevelMeshOutput& out)
+{
+    std::vector<uint8_t> exposed = ExposedFaces(cubes);
+    mesh.faces.assign(cubes.size() * CUBE_FACE_COUNT, MeshRange{0, 0});
+    size_t vertexCount = 0, litCount = 0, emissiveCount = 0;
+    CountCubeFaces(cubes, exposed, mesh, vertexCount, litCount, emissiveCount);
+    mesh.vertexCount = vertexCount;
+    mesh.indexCount = litCount + emissiveCount;
+    mesh.emissive = MeshRange{(uint32_t)litCount, (uint32_t)emissiveCount};
+    out.allocate(mesh.vertexCount, mesh.indexCount);
+
+    LevelMeshBatcher batch(out, std::vector<size_t>{0, litCount});
+    StreamCubeFaces(cubes, exposed, batch);
+    batch.Flush();
+}
+
+// StreamLevelMesh into mesh's own vertices and indices
+inline void BuildLevelMesh(const std::vector<Cube>& cubes, LevelMesh& mesh)
+{
+    StreamLevelMesh(cubes, mesh, LevelMeshVectorOutput(mesh));
+}
+
+#endif
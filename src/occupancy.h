@@ -0,0 +1,91 @@
+#ifndef OCCUPANCY_H
+#define OCCUPANCY_H
+
+#include <cstdint>
+#include <vector>
+
+#include "structs.h"
+
+// Bit-packed voxel grid of every integer position covered by an occluder.
+// Built once from the cubes, so a point test is a single bit lookup instead
+// of a walk over the whole cube list. Bounds are inclusive on both corners,
+// same as the old AABB test.
+class OccupancyGrid
+{
+public:
+    Int3 origin{0,0,0};
+    Int3 size{0,0,0};
+    std::vector<uint64_t> bits;
+
+    void Build(const std::vector<Cube>& cubes)
+    {
+        bits.clear();
+        size = Int3{0,0,0};
+        bool first = true;
+        Int3 lo{0,0,0}, hi{0,0,0};
+        for (auto& c : cubes) {
+            if (!c.occluder) { continue; }
+            Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+            Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+            lo = first ? minCorner : MinInt3(lo, minCorner);
+            hi = first ? maxCorner : MaxInt3(hi, maxCorner);
+            first = false;
+        }
+        if (first) { return; }
+
+        origin = lo;
+        size = Int3{hi.x-lo.x+1, hi.y-lo.y+1, hi.z-lo.z+1};
+        bits.assign(((size_t)size.x*size.y*size.z + 63) / 64, 0);
+
+        for (auto& c : cubes) {
+            if (!c.occluder) { continue; }
+            Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+            Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+            for (int y = minCorner.y; y <= maxCorner.y; y++) {
+                for (int z = minCorner.z; z <= maxCorner.z; z++) {
+                    size_t row = index(Int3{minCorner.x,y,z});
+                    setRange(row, row + (maxCorner.x - minCorner.x) + 1);
+                }
+            }
+        }
+    }
+
+    bool IsOccupied(Int3 pos) const
+    {
+        int x = pos.x - origin.x;
+        int y = pos.y - origin.y;
+        int z = pos.z - origin.z;
+        // Unsigned compare catches both negative and too-large coordinates
+        if ((unsigned)x >= (unsigned)size.x ||
+            (unsigned)y >= (unsigned)size.y ||
+            (unsigned)z >= (unsigned)size.z) {
+            return false;
+        }
+        size_t i = index(pos);
+        return (bits[i >> 6] >> (i & 63)) & 1;
+    }
+
+private:
+    // x is the fastest axis and each y slice is contiguous, since the baker
+    // mostly queries the y=0 plane.
+    size_t index(Int3 pos) const
+    {
+        return (size_t)(pos.x - origin.x)
+             + (size_t)size.x * ((size_t)(pos.z - origin.z) + (size_t)size.z * (size_t)(pos.y - origin.y));
+    }
+
+    // Sets bits [begin, end)
+    void setRange(size_t begin, size_t end)
+    {
+        while (begin < end) {
+            size_t word = begin >> 6;
+            size_t bit = begin & 63;
+            size_t count = std::min<size_t>(64 - bit, end - begin);
+            uint64_t mask = (count == 64) ? ~0ull : (((1ull << count) - 1) << bit);
+            bits[word] |= mask;
+            begin += count;
+        }
+    }
+};
+
+#endif
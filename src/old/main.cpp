@@ -14,54 +14,15 @@
 
 #include "../shader.h"
 #include "../constants.h"
+#include "../mesh.h"
+#include "../greedymesh.h"
+#include "../vertexformat.h"
+#include "../lightmap.h"
+#include "../bakeworker.h"
 
 int windowWidth = 800;
 int windowHeight = 450;
 
-float vertices[] = {
-    -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
-     0.5f, -0.5f, -0.5f,  1.0f, 0.0f,
-     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f, 0.0f,
-
-    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
-     0.5f,  0.5f,  0.5f,  1.0f, 1.0f,
-    -0.5f,  0.5f,  0.5f,  0.0f, 1.0f,
-    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-
-    -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-    -0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-    -0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-
-     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-
-    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-     0.5f, -0.5f, -0.5f,  1.0f, 1.0f,
-     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-     0.5f, -0.5f,  0.5f,  1.0f, 0.0f,
-    -0.5f, -0.5f,  0.5f,  0.0f, 0.0f,
-    -0.5f, -0.5f, -0.5f,  0.0f, 1.0f,
-
-    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f,
-     0.5f,  0.5f, -0.5f,  1.0f, 1.0f,
-     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-     0.5f,  0.5f,  0.5f,  1.0f, 0.0f,
-    -0.5f,  0.5f,  0.5f,  0.0f, 0.0f,
-    -0.5f,  0.5f, -0.5f,  0.0f, 1.0f
-};
-
 /*
 glm::vec3 cubePositions[] = {
     glm::vec3( 0.0f,  0.0f,  0.0f), 
@@ -77,8 +38,37 @@ glm::vec3 cubePositions[] = {
 };
 */
 
-std::vector<Int3> lights;
+std::vector<PointLight> lights;
 std::vector<Cube> cubes;
+// Level geometry as uploaded, with the index range of every lightmap chart
+LevelMesh levelMesh;
+// Merge exposed emissive faces into maximal quads where that takes fewer
+// quads, rather than a quad per cube face. Off by default: the stock level
+// has nothing that merges.
+bool greedyMesh = false;
+// Layout of the level's vertex buffer; GenerateLevelMesh falls back to
+// floats for a level too big to pack
+LevelVertexFormat levelVertexFormat = LEVEL_VERTEX_PACKED;
+LightMapBaker baker;
+// Bakes on its own thread once started, then owns baker
+LightMapBakeWorker bakeWorker(baker);
+// Baked lightmaps are kept here between runs, keyed by a hash of the scene
+std::string lightMapCacheDir = "lightmap_cache";
+bool useLightMapCache = true;
+// Size the lightmap texture was last allocated with
+int lightMapWidth = 0;
+int lightMapHeight = 0;
+// Charts of the texture as uploaded, which is what draws have to go by
+// while the bake worker lays the atlas out again
+std::vector<LightMapChart> lightMapCharts;
+// Ring of pixel buffer objects baked blocks are uploaded through
+GLuint lightMapUploadBuffers[LIGHTMAP_UPLOAD_BUFFERS];
+int nextLightMapUploadBuffer = 0;
+// Bake without blocking: on the bake worker's thread, or if backgroundBake
+// is off inside the render loop, at most bakeBudgetMs of it per frame
+bool progressiveBake = true;
+bool backgroundBake = true;
+double bakeBudgetMs = 8.0;
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
@@ -87,29 +77,6 @@ void framebuffer_size_callback(GLFWwindow* window, int width, int height)
     glViewport(0, 0, width, height);
 }
 
-Int3 MinInt3(Int3 a, Int3 b) {
-    return Int3{std::min(a.x,b.x),std::min(a.y,b.y),std::min(a.z,b.z)};
-}
-
-Int3 MaxInt3(Int3 a, Int3 b) {
-    return Int3{std::max(a.x,b.x),std::max(a.y,b.y),std::max(a.z,b.z)};
-}
-
-bool CheckIfInsideCube(Int3 pos) {
-    for (auto& c : cubes) {
-        if (!c.occluder) { continue; }
-        Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
-        Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
-
-        if (pos.x >= minCorner.x && pos.x <= maxCorner.x &&
-            pos.y >= minCorner.y && pos.y <= maxCorner.y &&
-            pos.z >= minCorner.z && pos.z <= maxCorner.z) {
-            return true;
-        }
-    }
-    return false;
-}
-
 void loadTexture(std::string path, unsigned int& texture) {
     glGenTextures(1, &texture);
     glBindTexture(GL_TEXTURE_2D, texture); // all upcoming GL_TEXTURE_2D operations now have effect on this texture object
@@ -150,50 +117,103 @@ void loadTexture(std::string path, unsigned int& texture) {
     stbi_image_free(data);
 }
 
-float getDistance2D(int x0,int y0,int x1,int y1) {
-    return sqrt(pow(x1-x0,2)+pow(y1-y0,2));
+// Copies size bytes into the buffer bound to target at offset, through a
+// mapping of just that range, or with glBufferSubData if it won't map
+void WriteBufferRange(GLenum target, size_t offset, size_t size, const void* data) {
+    void* mapped = glMapBufferRange(target, offset, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+    if (mapped) {
+        memcpy(mapped, data, size);
+        // False if the buffer was lost while mapped, so write it again
+        if (glUnmapBuffer(target)) { return; }
+    }
+    glBufferSubData(target, offset, size, data);
 }
 
-void GenerateLevelMesh(uint &VBO) {
+// Builds the level as indexed triangles straight into VBO and EBO, a
+// batch at a time, so it never has the whole mesh in memory. Vertices are
+// packed on the way in unless levelVertexFormat says floats. Call with
+// the VAO bound, so it keeps the element buffer.
+void GenerateLevelMesh(uint &VBO, uint &EBO) {
+    if (levelVertexFormat == LEVEL_VERTEX_PACKED && !LevelFitsPackedVertices(cubes)) {
+        std::cout << "Level too big for packed vertices, using floats" << std::endl;
+        levelVertexFormat = LEVEL_VERTEX_FLOAT;
+    }
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    int fullSize = 6*6*5;
-    float newVerts[fullSize*cubes.size()];
-    for(unsigned int i = 0; i < cubes.size(); i++) {
-        for (unsigned int v = 0; v < fullSize; v++) {
-            switch (v % 5) {
-                case 0: // x
-                    if (vertices[v] < -0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerA.x;
-                    else if (vertices[v] > 0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerB.x;
-                    else
-                        newVerts[v + i*(fullSize)] = vertices[v];
-                    break;
-
-                case 1: // y
-                    if (vertices[v] < -0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerA.y;
-                    else if (vertices[v] > 0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerB.y;
-                    else
-                        newVerts[v + i*(fullSize)] = vertices[v];
-                    break;
-
-                case 2: // z
-                    if (vertices[v] < -0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerA.z;
-                    else if (vertices[v] > 0.1f)
-                        newVerts[v + i*(fullSize)] = (float)cubes[i].cornerB.z;
-                    else
-                        newVerts[v + i*(fullSize)] = vertices[v];
-                    break;
-                default: // texcoords or other
-                    newVerts[v + i*(fullSize)] = vertices[v];
-                    break;
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+    // Reused for every batch
+    std::vector<PackedLevelVertex> packed;
+    LevelMeshOutput out;
+    out.allocate = [](size_t vertexCount, size_t indexCount) {
+        glBufferData(GL_ARRAY_BUFFER, vertexCount * LevelVertexBytes(levelVertexFormat), NULL, GL_STATIC_DRAW);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(uint32_t), NULL, GL_STATIC_DRAW);
+    };
+    out.writeVertices = [&packed](size_t first, const float* vertices, size_t count) {
+        if (levelVertexFormat == LEVEL_VERTEX_PACKED) {
+            packed.resize(count);
+            for (size_t i = 0; i < count; i++) {
+                packed[i] = PackLevelVertex(vertices + i * 5);
             }
+            WriteBufferRange(GL_ARRAY_BUFFER, first * sizeof(PackedLevelVertex), count * sizeof(PackedLevelVertex), packed.data());
+        } else {
+            WriteBufferRange(GL_ARRAY_BUFFER, first * 5 * sizeof(float), count * 5 * sizeof(float), vertices);
         }
+    };
+    out.writeIndices = [](size_t first, const uint32_t* indices, size_t count) {
+        WriteBufferRange(GL_ELEMENT_ARRAY_BUFFER, first * sizeof(uint32_t), count * sizeof(uint32_t), indices);
+    };
+    if (greedyMesh) {
+        StreamGreedyLevelMesh(cubes, levelMesh, out);
+    } else {
+        StreamLevelMesh(cubes, levelMesh, out);
+    }
+}
+
+// GL formats a lightmap storage format is uploaded with
+void LightMapGLFormat(LightMapFormat format, GLint& internalFormat, GLenum& pixelFormat, GLenum& type) {
+    switch (format) {
+        case LIGHTMAP_R8:
+            internalFormat = GL_R8; pixelFormat = GL_RED; type = GL_UNSIGNED_BYTE;
+            break;
+        case LIGHTMAP_R16F:
+            internalFormat = GL_R16F; pixelFormat = GL_RED; type = GL_HALF_FLOAT;
+            break;
+        case LIGHTMAP_RGB9E5:
+            internalFormat = GL_RGB9_E5; pixelFormat = GL_RGB; type = GL_UNSIGNED_INT_5_9_9_9_REV;
+            break;
+        case LIGHTMAP_FLOAT:
+        default:
+            internalFormat = GL_R32F; pixelFormat = GL_RED; type = GL_FLOAT;
+            break;
+    }
+}
+
+// Allocates the lightmap texture at the baker's atlas size and uploads all
+// of it, or with empty set leaves the texels for later uploads to fill in
+void UploadLightMap(bool empty = false) {
+    GLint internalFormat;
+    GLenum pixelFormat, type;
+    LightMapGLFormat(baker.format, internalFormat, pixelFormat, type);
+    lightMapWidth = baker.atlasWidth;
+    lightMapHeight = baker.atlasHeight;
+    lightMapCharts = baker.charts;
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, lightMapWidth, lightMapHeight, 0, pixelFormat, type, empty ? NULL : baker.UploadRow(0));
+}
+
+void ReportLightMap(uint64_t rays) {
+    size_t texels = 0;
+    for (auto& c : lightMapCharts) {
+        texels += (size_t)c.width * c.height;
+    }
+    std::cout << "Baked lightmap: " << rays << " rays for "
+              << texels * lights.size() << " texel/light pairs" << std::endl;
+}
+
+// Reports a finished bake and saves it for the next run
+void FinishLightMap() {
+    ReportLightMap(baker.samplesTraced);
+    if (useLightMapCache && !baker.SaveToCache(lightMapCacheDir)) {
+        std::cout << "Failed to write lightmap cache to \"" << lightMapCacheDir << "\"" << std::endl;
     }
-    glBufferData(GL_ARRAY_BUFFER, sizeof(newVerts), newVerts, GL_STATIC_DRAW);
 }
 
 void GenerateLightMap(uint& lightMap) {
@@ -206,82 +226,207 @@ void GenerateLightMap(uint& lightMap) {
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-    // Total size of all combined lightmaps
-    std::vector<float> data(64*TOTAL_LIGHTMAP_SIZE);
-    int maxSteps = 256;
-    for (int ci = 0; ci < cubes.size(); ci++) {
-        auto& c = cubes[ci];
-        for (int y = 0; y < c.lightMapScale; y++) {
-            for (int x = 0; x < c.lightMapScale; x++) {
-                float currentLightValue = 0.0;
-                for (auto l : lights) {
-                    for (int aa = 0; aa < 4; aa++) {
-                        float nudgeX = 0.5;
-                        float nudgeY = 0.5;
-                        switch (aa) {
-                            case 0:
-                                break;
-                            case 1:
-                                nudgeX *= -1.0;
-                                break;
-                            case 2:
-                                nudgeY *= -1.0;
-                                break;
-                            case 3:
-                                nudgeX *= -1.0;
-                                nudgeY *= -1.0;
-                                break;
-                        }
-                        float dx = l.x - x + nudgeX;
-                        float dy = l.z - y + nudgeY;
-                        float distance = std::sqrt(dx * dx + dy * dy);
-                
-                        if (distance == 0) {
-                            currentLightValue += 1.0f;
-                            continue;
-                        }
-                
-                        float stepX = dx / distance;
-                        float stepY = dy / distance;
-                
-                        float currentX = x + 0.5f;
-                        float currentY = y + 0.5f;
-                        bool blocked = false;
-                
-                        for (int step = 0; step < std::min((int)distance, maxSteps); step++) {
-                            int mapX = (int)currentX;
-                            int mapY = (int)currentY;
-                            
-                            if (CheckIfInsideCube(Int3{mapX,0,mapY})) {
-                                blocked = true;
-                                break;
-                            }
-                
-                            currentX += stepX;
-                            currentY += stepY;
-                        }
-                
-                        if (!blocked) {
-                            currentLightValue += 1.0f - getDistance2D(x, y, l.x, l.z) * 0.02f;
-                        }
-                    }
-                    // Divided by 4 to account for 4 AA samples
-                    data[x + y * c.lightMapScale + (c.lightMapScale*c.lightMapScale) * ci] = currentLightValue/4.0;
-                }
-            }
+    baker.SetScene(cubes, lights);
+    if (!useLightMapCache || !baker.LoadFromCache(lightMapCacheDir)) {
+        if (progressiveBake) {
+            // Only lays the atlas out; the scene is prepared and the texture
+            // filled in over the next frames
+            baker.BeginProgressiveBake();
+        } else {
+            baker.Bake();
+            FinishLightMap();
         }
     }
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, 64, TOTAL_LIGHTMAP_SIZE, 0, GL_RED, GL_FLOAT, data.data());
+    // R8 rows aren't always a multiple of 4 bytes
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    // The coarse pass covers every chart long before the shadows come in
+    UploadLightMap(baker.ProgressiveBaking());
+
+    if (progressiveBake && backgroundBake) {
+        glGenBuffers(LIGHTMAP_UPLOAD_BUFFERS, lightMapUploadBuffers);
+        bakeWorker.cacheDir = useLightMapCache ? lightMapCacheDir : "";
+        bakeWorker.Start();
+    }
+}
+
+// Call after editing cubes or lights. Only texels the edit can reach are
+// traced again, and only the rows that changed are uploaded.
+void UpdateLightMap(uint lightMap) {
+    // The worker re-bakes in the background, DrainLightMap picks it up
+    if (bakeWorker.Running()) {
+        bakeWorker.UpdateScene(cubes, lights);
+        return;
+    }
+    std::vector<RowSpan> rows = baker.UpdateScene(cubes, lights);
+    lightMapCharts = baker.charts;
+    glBindTexture(GL_TEXTURE_2D, lightMap);
+    // The atlas grew, so the texture has to be allocated again
+    if (baker.atlasWidth != lightMapWidth || baker.atlasHeight != lightMapHeight) {
+        UploadLightMap();
+        return;
+    }
+    GLint internalFormat;
+    GLenum pixelFormat, type;
+    LightMapGLFormat(baker.format, internalFormat, pixelFormat, type);
+    for (auto& r : rows) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, r.first, lightMapWidth, r.count, pixelFormat, type, baker.UploadRow(r.first));
+    }
+}
+
+// Call once a frame while a progressive bake runs. Bakes for up to
+// bakeBudgetMs and uploads the tiles that came out of it.
+void StepLightMap(uint lightMap) {
+    std::vector<AtlasRect> rects = baker.StepProgressiveBake(bakeBudgetMs);
+    glBindTexture(GL_TEXTURE_2D, lightMap);
+    GLint internalFormat;
+    GLenum pixelFormat, type;
+    LightMapGLFormat(baker.format, internalFormat, pixelFormat, type);
+    // Tiles are blocks out of the middle of the atlas rows
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, lightMapWidth);
+    for (auto& r : rects) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, r.x, r.y, r.width, r.height, pixelFormat, type, baker.UploadTexel(r.x, r.y));
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    if (!baker.ProgressiveBaking()) {
+        FinishLightMap();
+    }
+}
+
+// Uploads one block of texels by way of the next buffer in the ring. The
+// buffer is orphaned first, so the copy into it never waits on the GPU
+// still reading what went in last time round.
+void UploadLightMapBlock(const BakedBlock& block, GLenum pixelFormat, GLenum type) {
+    GLuint buffer = lightMapUploadBuffers[nextLightMapUploadBuffer];
+    nextLightMapUploadBuffer = (nextLightMapUploadBuffer + 1) % LIGHTMAP_UPLOAD_BUFFERS;
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, block.bytes.size(), NULL, GL_STREAM_DRAW);
+    void* mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, block.bytes.size(),
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    const void* pixels = (const void*)0;
+    if (mapped) {
+        memcpy(mapped, block.bytes.data(), block.bytes.size());
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    } else {
+        // Couldn't map it, upload straight from the block instead
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        pixels = block.bytes.data();
+    }
+    glTexSubImage2D(GL_TEXTURE_2D, 0, block.rect.x, block.rect.y, block.rect.width, block.rect.height,
+        pixelFormat, type, pixels);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+// Call once a frame while the bake worker runs. Uploads what it finished
+// since, up to LIGHTMAP_UPLOAD_BUDGET bytes; the rest waits for the next
+// frame. Never waits on the worker.
+void DrainLightMap(uint lightMap) {
+    glBindTexture(GL_TEXTURE_2D, lightMap);
+    GLint internalFormat;
+    GLenum pixelFormat, type;
+    LightMapGLFormat(baker.format, internalFormat, pixelFormat, type);
+    size_t uploaded = 0;
+    BakedBlock block;
+    while (uploaded < LIGHTMAP_UPLOAD_BUDGET && bakeWorker.TryPop(block)) {
+        if (block.bakeDone) {
+            ReportLightMap(block.raysTraced);
+            continue;
+        }
+        if (block.layout) {
+            // Laid out again: new texture size and charts, and the block
+            // holds all of it
+            lightMapWidth = block.layout->atlasWidth;
+            lightMapHeight = block.layout->atlasHeight;
+            lightMapCharts = block.layout->charts;
+            glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, lightMapWidth, lightMapHeight, 0, pixelFormat, type, NULL);
+        }
+        UploadLightMapBlock(block, pixelFormat, type);
+        uploaded += block.bytes.size();
+    }
 }
 
 int main(int argc, char *argv[])
 {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        // -j N: lightmap bake threads, 1 bakes on the main thread
+        if (arg == "-j" && i + 1 < argc) {
+            baker.workers = (unsigned int)std::max(0, atoi(argv[++i]));
+        }
+        // --adaptive-aa: extra lightmap samples only along shadow edges,
+        // ignored with --light-cuts
+        if (arg == "--adaptive-aa") {
+            baker.adaptiveAA = true;
+        }
+        // --polar-shadows N: look light visibility up in per-light polar
+        // shadow maps, filtered over N bins either side
+        if (arg == "--polar-shadows" && i + 1 < argc) {
+            baker.visibilityMode = VISIBILITY_POLAR;
+            baker.polarFilter = std::max(0, atoi(argv[++i]));
+        }
+        // --sdf-shadows: trace light visibility through a distance field of
+        // the occluders; --sdf-soft K adds soft shadows, K the softness
+        if (arg == "--sdf-shadows") {
+            baker.visibilityMode = VISIBILITY_SDF;
+        }
+        if (arg == "--sdf-soft" && i + 1 < argc) {
+            baker.visibilityMode = VISIBILITY_SDF;
+            baker.sdfSoftShadows = true;
+            baker.sdfSoftness = (float)atof(argv[++i]);
+        }
+        // --light-cuts E: cluster point lights in a light tree and light
+        // each texel from a cut through it, E the error bound
+        if (arg == "--light-cuts" && i + 1 < argc) {
+            baker.lightCuts = true;
+            baker.lightCutError = (float)atof(argv[++i]);
+        }
+        // --indirect N: bounces of indirect light in the lightmap, 0 for direct only
+        if (arg == "--indirect" && i + 1 < argc) {
+            baker.indirectBounces = std::max(0, atoi(argv[++i]));
+        }
+        // --lightmap-format float|r8|r16f|rgb9e5: how the lightmap is stored on the GPU
+        if (arg == "--lightmap-format" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name == "r8") { baker.format = LIGHTMAP_R8; }
+            else if (name == "r16f") { baker.format = LIGHTMAP_R16F; }
+            else if (name == "rgb9e5") { baker.format = LIGHTMAP_RGB9E5; }
+            else { baker.format = LIGHTMAP_FLOAT; }
+        }
+        // --blocking-bake: bake the whole lightmap before opening the window
+        if (arg == "--blocking-bake") {
+            progressiveBake = false;
+        }
+        // --bake-in-frame: bake a slice per frame on the main thread, no bake worker
+        if (arg == "--bake-in-frame") {
+            backgroundBake = false;
+        }
+        // --bake-budget MS: milliseconds per frame a progressive bake may take
+        if (arg == "--bake-budget" && i + 1 < argc) {
+            bakeBudgetMs = std::max(0.0, atof(argv[++i]));
+        }
+        // --greedy-mesh: merge emissive faces on a plane into fewer, larger quads
+        if (arg == "--greedy-mesh") {
+            greedyMesh = true;
+        }
+        // --float-vertices: upload level vertices as plain floats, for debugging
+        if (arg == "--float-vertices") {
+            levelVertexFormat = LEVEL_VERTEX_FLOAT;
+        }
+        // --no-bake-cache: always bake, never read or write the cache
+        if (arg == "--no-bake-cache") {
+            useLightMapCache = false;
+        }
+    }
+
     // Lights
-    lights.push_back(Int3{ 16,0,38});
-    //lights.push_back(Int3{ 64,0,64});
+    lights.push_back(PointLight{Int3{ 16,0,38}, 0.02f});
+    //lights.push_back(PointLight{Int3{ 64,0,64}, 0.02f});
+    // A soft shadowed disc light, 3 cells across
+    //lights.push_back(PointLight{Int3{ 40,0,20}, 0.02f, LIGHT_DISC, 1.5f});
 
     // Cubes
     cubes.push_back(Cube{Int3{0,0,64},Int3{64,0,0},"brick_dithered_big",false,false});
+    // The ground is only ever seen from above
+    cubes.back().faces = FACE_TOP;
     cubes.push_back(Cube{Int3{0,0,0},Int3{10,10,10}});
     cubes.push_back(Cube{Int3{30,0,10},Int3{50,5,20}});
     cubes.push_back(Cube{Int3{50,0,20},Int3{60,20,30}});
@@ -316,20 +461,32 @@ int main(int argc, char *argv[])
     Shader ourShader("shaders/shader.vs", "shaders/shader.fs");
 
     // VBO
-    unsigned int VBO, VAO;
+    unsigned int VBO, EBO, VAO;
     glGenVertexArrays(1, &VAO);
     glGenBuffers(1, &VBO);
+    glGenBuffers(1, &EBO);
 
     glBindVertexArray(VAO);
 
-    GenerateLevelMesh(VBO);
-
-    // position attribute
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
-    glEnableVertexAttribArray(0);
-    // texture coord attribute
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
-    glEnableVertexAttribArray(1);
+    GenerateLevelMesh(VBO, EBO);
+
+    if (levelVertexFormat == LEVEL_VERTEX_PACKED) {
+        // Integer attributes, the vertex shader turns them back into floats
+        GLsizei stride = sizeof(PackedLevelVertex);
+        glVertexAttribIPointer(2, 3, GL_SHORT, stride, (void*)offsetof(PackedLevelVertex, pos));
+        glEnableVertexAttribArray(2);
+        glVertexAttribIPointer(3, 2, GL_SHORT, stride, (void*)offsetof(PackedLevelVertex, uv));
+        glEnableVertexAttribArray(3);
+        glVertexAttribIPointer(4, 1, GL_UNSIGNED_SHORT, stride, (void*)offsetof(PackedLevelVertex, uvShift));
+        glEnableVertexAttribArray(4);
+    } else {
+        // position attribute
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+        glEnableVertexAttribArray(0);
+        // texture coord attribute
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(3 * sizeof(float)));
+        glEnableVertexAttribArray(1);
+    }
 
     // load and create a texture 
     // -------------------------
@@ -349,6 +506,9 @@ int main(int argc, char *argv[])
     ourShader.setFloat("TextureScaleHorizontal", 4.0);
     ourShader.setFloat("TextureScaleVertical", 4.0);
     ourShader.setInt("LightMap", 1); // or with shader class
+    ourShader.setBool("PackedVertices", levelVertexFormat == LEVEL_VERTEX_PACKED);
+    // R8 only covers [0,1], scaled back up to the baked range here
+    ourShader.setFloat("LightMapRange", baker.format == LIGHTMAP_R8 ? baker.texelRange : 1.0f);
 
     glm::mat4 model = glm::mat4(1.0f);
     //model = glm::rotate(model, glm::radians(90.0f), glm::vec3(0.0, 0.0, 1.0));
@@ -379,12 +539,33 @@ int main(int argc, char *argv[])
         view = glm::lookAt(glm::vec3(32.0 + camX, 16.0, 32.0 + camZ), glm::vec3(32.0, 0.0, 32.0), glm::vec3(0.0, 1.0, 0.0));  
 
         ourShader.setMat4("view",view);
+
+        if (bakeWorker.Running()) {
+            glActiveTexture(GL_TEXTURE1);
+            DrainLightMap(lightMap);
+        } else if (baker.ProgressiveBaking()) {
+            glActiveTexture(GL_TEXTURE1);
+            StepLightMap(lightMap);
+        }
         
         glBindVertexArray(VAO);
-        for (int ci = 0; ci < cubes.size(); ci++) {
-            ourShader.setInt("LightMapOffset", ci+1);
-            ourShader.setBool("Emissive", cubes[ci].emissive);
-            glDrawArrays(GL_TRIANGLES, 36*ci, 36*(ci+1));
+        ourShader.setBool("Emissive", true);
+        glDrawElements(GL_TRIANGLES, levelMesh.emissive.count, GL_UNSIGNED_INT,
+            (void*)(levelMesh.emissive.first * sizeof(uint32_t)));
+        ourShader.setBool("Emissive", false);
+        for (int chartIndex = 0; chartIndex < levelMesh.faces.size(); chartIndex++) {
+            // Masked out, covered and emissive faces have nothing here
+            const MeshRange& range = levelMesh.faces[chartIndex];
+            if (range.count == 0) { continue; }
+            // Faces the baker found hidden have no chart and aren't drawn,
+            // nor are cubes added since the texture was last laid out
+            if (chartIndex >= lightMapCharts.size()) { continue; }
+            const LightMapChart& chart = lightMapCharts[chartIndex];
+            if (chart.width == 0) { continue; }
+            ourShader.setVec4("LightMapRect",
+                chart.x / (float)lightMapWidth, chart.y / (float)lightMapHeight,
+                chart.width / (float)lightMapWidth, chart.height / (float)lightMapHeight);
+            glDrawElements(GL_TRIANGLES, range.count, GL_UNSIGNED_INT, (void*)(range.first * sizeof(uint32_t)));
         }
 
         // swap buffers and poll IO events
@@ -394,8 +575,13 @@ int main(int argc, char *argv[])
 
     // optional: de-allocate all resources once they've outlived their purpose:
     // ------------------------------------------------------------------------
+    bakeWorker.Stop();
+    if (progressiveBake && backgroundBake) {
+        glDeleteBuffers(LIGHTMAP_UPLOAD_BUFFERS, lightMapUploadBuffers);
+    }
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
+    glDeleteBuffers(1, &EBO);
 
     // glfw: terminate, clearing all previously allocated GLFW resources.
     // ------------------------------------------------------------------
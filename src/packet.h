@@ -0,0 +1,224 @@
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <cstdint>
+
+#include "occupancy.h"
+#include "traversal.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+// Traces many DDA visibility rays at once through horizontal layers of an
+// occupancy grid, one ray per SIMD lane and each in its own y layer. Lanes
+// drop out of the packet as soon as they hit something or run out of cells,
+// and the packet ends when all lanes have. Every lane makes the same float
+// decisions as TraverseCells2D, so results match the scalar kernel bit for
+// bit.
+
+enum SimdLevel {
+    SIMD_SCALAR,
+    SIMD_SSE2, // 4 lanes, cell lookups done per lane
+    SIMD_AVX2  // 8 lanes, cell lookups gathered
+};
+
+inline SimdLevel DetectSimdLevel()
+{
+#ifdef PACKET_X86
+    if (__builtin_cpu_supports("avx2")) { return SIMD_AVX2; }
+    if (__builtin_cpu_supports("sse2")) { return SIMD_SSE2; }
+#endif
+    return SIMD_SCALAR;
+}
+
+inline void TracePacketScalar(const OccupancyGrid& grid, const CellWalk2D* walks, const int* layers, uint8_t* blocked, int count)
+{
+    for (int i = 0; i < count; i++) {
+        CellWalk2D w = walks[i];
+        blocked[i] = 0;
+        for (;;) {
+            if (grid.IsOccupied(Int3{w.cellX,layers[i],w.cellY})) {
+                blocked[i] = 1;
+                break;
+            }
+            if (w.remainingX + w.remainingY == 0) { break; }
+            StepCellWalk2D(w);
+        }
+    }
+}
+
+#ifdef PACKET_X86
+
+__attribute__((target("sse2")))
+inline void TracePacketSSE2(const OccupancyGrid& grid, const CellWalk2D* walks, const int* layers, uint8_t* blocked, int count)
+{
+    for (int base = 0; base < count; base += 4) {
+        int n = std::min(4, count - base);
+        alignas(16) int cx[4] = {}, cy[4] = {}, sx[4] = {}, sy[4] = {}, rx[4] = {}, ry[4] = {};
+        int layer[4] = {};
+        alignas(16) float mx[4] = {}, my[4] = {}, ddx[4] = {}, ddy[4] = {};
+        int active = 0;
+        for (int l = 0; l < n; l++) {
+            const CellWalk2D& w = walks[base + l];
+            cx[l] = w.cellX; cy[l] = w.cellY; sx[l] = w.stepX; sy[l] = w.stepY;
+            rx[l] = w.remainingX; ry[l] = w.remainingY;
+            mx[l] = w.tMaxX; my[l] = w.tMaxY; ddx[l] = w.tDeltaX; ddy[l] = w.tDeltaY;
+            layer[l] = layers[base + l];
+            active |= 1 << l;
+            blocked[base + l] = 0;
+        }
+
+        __m128i cellX = _mm_load_si128((const __m128i*)cx);
+        __m128i cellY = _mm_load_si128((const __m128i*)cy);
+        __m128i stepX = _mm_load_si128((const __m128i*)sx);
+        __m128i stepY = _mm_load_si128((const __m128i*)sy);
+        __m128i remX = _mm_load_si128((const __m128i*)rx);
+        __m128i remY = _mm_load_si128((const __m128i*)ry);
+        __m128 tMaxX = _mm_load_ps(mx);
+        __m128 tMaxY = _mm_load_ps(my);
+        __m128 tDeltaX = _mm_load_ps(ddx);
+        __m128 tDeltaY = _mm_load_ps(ddy);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi32(-1);
+
+        for (;;) {
+            _mm_store_si128((__m128i*)cx, cellX);
+            _mm_store_si128((__m128i*)cy, cellY);
+            for (int l = 0; l < 4; l++) {
+                if ((active >> l) & 1 && grid.IsOccupied(Int3{cx[l],layer[l],cy[l]})) {
+                    blocked[base + l] = 1;
+                    active &= ~(1 << l);
+                }
+            }
+            __m128i done = _mm_cmpeq_epi32(_mm_add_epi32(remX, remY), zero);
+            active &= ~_mm_movemask_ps(_mm_castsi128_ps(done));
+            if (!active) { break; }
+
+            __m128i alongX = _mm_or_si128(_mm_cmpeq_epi32(remY, zero),
+                _mm_and_si128(_mm_cmpgt_epi32(remX, zero), _mm_castps_si128(_mm_cmplt_ps(tMaxX, tMaxY))));
+            cellX = _mm_add_epi32(cellX, _mm_and_si128(alongX, stepX));
+            cellY = _mm_add_epi32(cellY, _mm_andnot_si128(alongX, stepY));
+            tMaxX = _mm_add_ps(tMaxX, _mm_and_ps(_mm_castsi128_ps(alongX), tDeltaX));
+            tMaxY = _mm_add_ps(tMaxY, _mm_andnot_ps(_mm_castsi128_ps(alongX), tDeltaY));
+            // Masks are -1 per true lane, so adding them counts down
+            remX = _mm_add_epi32(remX, alongX);
+            remY = _mm_add_epi32(remY, _mm_xor_si128(alongX, ones));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+inline void TracePacketAVX2(const OccupancyGrid& grid, const CellWalk2D* walks, const int* layers, uint8_t* blocked, int count)
+{
+    // The grid read as 32-bit words for the gather
+    const int* words = (const int*)grid.bits.data();
+    const __m256i gridX = _mm256_set1_epi32(grid.origin.x);
+    const __m256i gridZ = _mm256_set1_epi32(grid.origin.z);
+    const __m256i sizeX = _mm256_set1_epi32(grid.size.x);
+    const __m256i sizeZ = _mm256_set1_epi32(grid.size.z);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi32(-1);
+    const __m256i minusOne = ones;
+    const __m256i bitMask = _mm256_set1_epi32(31);
+    const __m256i one = _mm256_set1_epi32(1);
+
+    for (int base = 0; base < count; base += 8) {
+        int n = std::min(8, count - base);
+        alignas(32) int cx[8] = {}, cy[8] = {}, sx[8] = {}, sy[8] = {}, rx[8] = {}, ry[8] = {};
+        alignas(32) float mx[8] = {}, my[8] = {}, ddx[8] = {}, ddy[8] = {};
+        alignas(32) int lanes[8] = {};
+        alignas(32) int bases[8] = {};
+        for (int l = 0; l < n; l++) {
+            const CellWalk2D& w = walks[base + l];
+            cx[l] = w.cellX; cy[l] = w.cellY; sx[l] = w.stepX; sy[l] = w.stepY;
+            rx[l] = w.remainingX; ry[l] = w.remainingY;
+            mx[l] = w.tMaxX; my[l] = w.tMaxY; ddx[l] = w.tDeltaX; ddy[l] = w.tDeltaY;
+            // A ray in a layer outside the grid can't hit anything, so its
+            // lane starts out finished
+            int layer = layers[base + l] - grid.origin.y;
+            if (layer >= 0 && layer < grid.size.y) {
+                bases[l] = grid.size.x * grid.size.z * layer;
+                lanes[l] = -1;
+            }
+        }
+
+        __m256i cellX = _mm256_load_si256((const __m256i*)cx);
+        __m256i cellY = _mm256_load_si256((const __m256i*)cy);
+        __m256i stepX = _mm256_load_si256((const __m256i*)sx);
+        __m256i stepY = _mm256_load_si256((const __m256i*)sy);
+        __m256i remX = _mm256_load_si256((const __m256i*)rx);
+        __m256i remY = _mm256_load_si256((const __m256i*)ry);
+        __m256 tMaxX = _mm256_load_ps(mx);
+        __m256 tMaxY = _mm256_load_ps(my);
+        __m256 tDeltaX = _mm256_load_ps(ddx);
+        __m256 tDeltaY = _mm256_load_ps(ddy);
+        __m256i active = _mm256_load_si256((const __m256i*)lanes);
+        __m256i sliceBase = _mm256_load_si256((const __m256i*)bases);
+        __m256i hitLanes = zero;
+
+        for (;;) {
+            {
+                __m256i lx = _mm256_sub_epi32(cellX, gridX);
+                __m256i lz = _mm256_sub_epi32(cellY, gridZ);
+                __m256i inside = _mm256_and_si256(
+                    _mm256_and_si256(_mm256_cmpgt_epi32(lx, minusOne), _mm256_cmpgt_epi32(sizeX, lx)),
+                    _mm256_and_si256(_mm256_cmpgt_epi32(lz, minusOne), _mm256_cmpgt_epi32(sizeZ, lz)));
+                inside = _mm256_and_si256(inside, active);
+                __m256i index = _mm256_add_epi32(sliceBase, _mm256_add_epi32(lx, _mm256_mullo_epi32(sizeX, lz)));
+                __m256i word = _mm256_mask_i32gather_epi32(zero, words, _mm256_srli_epi32(index, 5), inside, 4);
+                __m256i bit = _mm256_and_si256(_mm256_srlv_epi32(word, _mm256_and_si256(index, bitMask)), one);
+                __m256i hit = _mm256_and_si256(_mm256_cmpeq_epi32(bit, one), inside);
+                hitLanes = _mm256_or_si256(hitLanes, hit);
+                active = _mm256_andnot_si256(hit, active);
+            }
+            __m256i done = _mm256_cmpeq_epi32(_mm256_add_epi32(remX, remY), zero);
+            active = _mm256_andnot_si256(done, active);
+            if (_mm256_testz_si256(active, active)) { break; }
+
+            __m256i alongX = _mm256_or_si256(_mm256_cmpeq_epi32(remY, zero),
+                _mm256_and_si256(_mm256_cmpgt_epi32(remX, zero),
+                    _mm256_castps_si256(_mm256_cmp_ps(tMaxX, tMaxY, _CMP_LT_OQ))));
+            cellX = _mm256_add_epi32(cellX, _mm256_and_si256(alongX, stepX));
+            cellY = _mm256_add_epi32(cellY, _mm256_andnot_si256(alongX, stepY));
+            tMaxX = _mm256_add_ps(tMaxX, _mm256_and_ps(_mm256_castsi256_ps(alongX), tDeltaX));
+            tMaxY = _mm256_add_ps(tMaxY, _mm256_andnot_ps(_mm256_castsi256_ps(alongX), tDeltaY));
+            // Masks are -1 per true lane, so adding them counts down
+            remX = _mm256_add_epi32(remX, alongX);
+            remY = _mm256_add_epi32(remY, _mm256_xor_si256(alongX, ones));
+        }
+
+        int hits = _mm256_movemask_ps(_mm256_castsi256_ps(hitLanes));
+        for (int l = 0; l < n; l++) {
+            blocked[base + l] = (hits >> l) & 1;
+        }
+    }
+}
+
+#endif
+
+// The gather indexes 32-bit words with signed 32-bit lane offsets
+inline bool PacketGridFits(const OccupancyGrid& grid)
+{
+    return grid.bits.size() * 2 < (size_t)INT32_MAX / 32;
+}
+
+// Traces count walks, walk i in grid layer y = layers[i], writing 1 into
+// blocked for every ray that hits an occupied cell and 0 otherwise
+inline void TracePacketDDA(const OccupancyGrid& grid, const CellWalk2D* walks, const int* layers, uint8_t* blocked, int count, SimdLevel level)
+{
+#ifdef PACKET_X86
+    if (level == SIMD_AVX2 && PacketGridFits(grid)) {
+        TracePacketAVX2(grid, walks, layers, blocked, count);
+        return;
+    }
+    if (level >= SIMD_SSE2) {
+        TracePacketSSE2(grid, walks, layers, blocked, count);
+        return;
+    }
+#endif
+    TracePacketScalar(grid, walks, layers, blocked, count);
+}
+
+#endif
@@ -0,0 +1,163 @@
+#ifndef POLARSHADOW_H
+#define POLARSHADOW_H
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "structs.h"
+
+// Widest a bin may get where the light runs out, in cells. Keeps a bin
+// narrower than the cell the dirty boxes of an edit are grown by.
+#define POLAR_SHADOW_BIN_ARC 0.5f
+#define POLAR_SHADOW_MIN_BINS 64
+#define POLAR_SHADOW_MAX_BINS 8192
+// How far past the nearest occluder in its bin a point may sit and still be
+// lit. Less than the cell any ray spends inside an occluder, so a wall
+// always shadows what's behind it, but enough that walls don't shadow the
+// texels just in front of them.
+#define POLAR_SHADOW_BIAS 0.5f
+
+// 1D shadow map of one point light: for every grid layer the occluders
+// cover, a ring of angle bins around the middle of the light's cell, each
+// holding the distance to the nearest occluder in it. Whether a point sees
+// the light is then one lookup and one compare.
+struct PolarShadowMap {
+    float centerX, centerZ;
+    int bins;
+    // Layers [firstLayer, firstLayer + layers) have a ring each, bins
+    // floats long. Every other layer has nothing in it.
+    int firstLayer;
+    int layers;
+    std::vector<float> depth;
+
+    // Builds the rings from every occluder box the light can reach
+    void Build(const std::vector<Cube>& cubes, const PointLight& light)
+    {
+        centerX = light.pos.x + 0.5f;
+        centerZ = light.pos.z + 0.5f;
+        // Texels are measured from their corner and sit at most a cell from
+        // it, so nothing lit is further than this from the center
+        float range = light.falloff > 0.0f ? 1.0f / light.falloff + 2.0f : std::numeric_limits<float>::infinity();
+        float wanted = 6.28318531f * range / POLAR_SHADOW_BIN_ARC;
+        bins = POLAR_SHADOW_MIN_BINS;
+        while (bins < POLAR_SHADOW_MAX_BINS && bins < wanted) {
+            bins *= 2;
+        }
+
+        std::vector<const Cube*> near;
+        int lo = 0, hi = -1;
+        for (auto& c : cubes) {
+            if (!c.occluder) { continue; }
+            Int3 minCorner = MinInt3(c.cornerA, c.cornerB);
+            Int3 maxCorner = MaxInt3(c.cornerA, c.cornerB);
+            float nearestX = std::min(std::max(centerX, (float)minCorner.x), maxCorner.x + 1.0f);
+            float nearestZ = std::min(std::max(centerZ, (float)minCorner.z), maxCorner.z + 1.0f);
+            float toX = nearestX - centerX, toZ = nearestZ - centerZ;
+            if (toX * toX + toZ * toZ > range * range) { continue; }
+            lo = near.empty() ? minCorner.y : std::min(lo, minCorner.y);
+            hi = near.empty() ? maxCorner.y : std::max(hi, maxCorner.y);
+            near.push_back(&c);
+        }
+        firstLayer = lo;
+        layers = hi - lo + 1;
+        depth.assign((size_t)layers * bins, std::numeric_limits<float>::infinity());
+
+        for (const Cube* c : near) {
+            Int3 minCorner = MinInt3(c->cornerA, c->cornerB);
+            Int3 maxCorner = MaxInt3(c->cornerA, c->cornerB);
+            // Solid over [min, max + 1], relative to the center
+            float x0 = minCorner.x - centerX, x1 = maxCorner.x + 1.0f - centerX;
+            float z0 = minCorner.z - centerZ, z1 = maxCorner.z + 1.0f - centerZ;
+            for (int y = minCorner.y; y <= maxCorner.y; y++) {
+                float* ring = &depth[(size_t)(y - firstLayer) * bins];
+                if (x0 < 0 && x1 > 0 && z0 < 0 && z1 > 0) {
+                    // The light is inside it: nothing gets out
+                    std::fill(ring, ring + bins, 0.0f);
+                    continue;
+                }
+                // Only the edges facing the light can be nearest
+                if (x0 > 0) { rasterizeEdge(ring, x0, z0, x0, z1); }
+                if (x1 < 0) { rasterizeEdge(ring, x1, z0, x1, z1); }
+                if (z0 > 0) { rasterizeEdge(ring, x0, z0, x1, z0); }
+                if (z1 < 0) { rasterizeEdge(ring, x0, z1, x1, z1); }
+            }
+        }
+    }
+
+    // Bin of the direction (dx, dz) from the center
+    int Bin(float dx, float dz) const
+    {
+        float turn = std::atan2(dz, dx) * (1.0f / 6.28318531f);
+        int bin = (int)std::floor((turn < 0.0f ? turn + 1.0f : turn) * bins);
+        return bin >= bins ? bin - bins : bin;
+    }
+
+    // Does (x, z) in layer see the center. binOffset looks that many bins
+    // to the side instead, for filtering.
+    bool Visible(int layer, float x, float z, int binOffset) const
+    {
+        int ring = layer - firstLayer;
+        if ((unsigned)ring >= (unsigned)layers) { return true; }
+        float dx = x - centerX, dz = z - centerZ;
+        int bin = (Bin(dx, dz) + binOffset) & (bins - 1);
+        return std::sqrt(dx * dx + dz * dz) < depth[(size_t)ring * bins + bin] + POLAR_SHADOW_BIAS;
+    }
+
+private:
+    // Lowers every bin the segment (ax, az)-(bx, bz) crosses to the nearest
+    // distance the segment comes to the center within that bin. The segment
+    // faces the center and never passes through it.
+    void rasterizeEdge(float* ring, float ax, float az, float bx, float bz) const
+    {
+        const float binAngle = 6.28318531f / bins;
+        float a0 = std::atan2(az, ax), a1 = std::atan2(bz, bx);
+        // Walk counterclockwise from a0 to a1; a segment spans less than half
+        // a turn, so that's whichever way round is shorter
+        float span = a1 - a0;
+        if (span < -3.14159265f) { span += 6.28318531f; }
+        if (span > 3.14159265f) { span -= 6.28318531f; }
+        if (span < 0.0f) {
+            std::swap(ax, bx);
+            std::swap(az, bz);
+            std::swap(a0, a1);
+            span = -span;
+        }
+        float ex = bx - ax, ez = bz - az;
+        float along = ax * ez - az * ex;
+        // Closest point of the segment's line, and its angle
+        float length2 = ex * ex + ez * ez;
+        float foot = -(ax * ex + az * ez) / length2;
+        float footAngle = std::atan2(az + ez * foot, ax + ex * foot) - a0;
+        if (footAngle < 0.0f) { footAngle += 6.28318531f; }
+        bool footInside = foot > 0.0f && foot < 1.0f;
+
+        // Distance along the ray at angle a0 + t to the segment's line
+        auto hit = [&](float t) {
+            float ux = std::cos(a0 + t), uz = std::sin(a0 + t);
+            return along / (ux * ez - uz * ex);
+        };
+
+        float start = a0 < 0.0f ? a0 + 6.28318531f : a0;
+        int first = std::min((int)(start / binAngle), bins - 1);
+        float t = 0.0f;
+        // Angle from a0 to the end of the first bin
+        float binEnd = (first + 1) * binAngle - start;
+        for (int bin = first; ; bin = (bin + 1) & (bins - 1)) {
+            float end = std::min(binEnd, span);
+            float nearest = std::min(hit(t), hit(end));
+            if (footInside && footAngle >= t && footAngle <= end) {
+                nearest = std::min(nearest, std::fabs(along) / std::sqrt(length2));
+            }
+            ring[bin] = std::min(ring[bin], std::max(0.0f, nearest));
+            if (end >= span) { break; }
+            t = end;
+            binEnd += binAngle;
+        }
+    }
+};
+
+typedef struct PolarShadowMap PolarShadowMap;
+
+#endif
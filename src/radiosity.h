@@ -0,0 +1,708 @@
+#ifndef RADIOSITY_H
+#define RADIOSITY_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <unordered_map>
+#include <vector>
+
+#include "structs.h"
+#include "mesh.h"
+#include "bvh.h"
+
+// One lit face as the radiosity solver sees it: where it is and the size of
+// the texel grid its direct light comes in. Faces without a chart have a
+// width of 0 and take no part.
+struct RadiosityFace {
+    CubeFace frame;
+    int width, height;
+    // Occluder + faces sit a cell out from their plane, as in the baker
+    bool occluder;
+};
+
+typedef struct RadiosityFace RadiosityFace;
+
+// Hierarchical radiosity over the cube faces (Hanrahan et al.). Every face
+// starts as one patch. A pair of patches that exchange a lot of light is
+// split, larger side first, until the form factor between them is under
+// epsilon or the patches are down to a texel, and only then linked. Far or
+// small pairs get one coarse link, near ones many fine links, so a pair of
+// faces costs about the same however many texels they have. Every pair
+// that faces each other within reach of minFormFactor still gets at least
+// one link, so in an open level the links grow with the square of the
+// faces. Links carry their visibility and are kept from one solve to the
+// next: an edit refines only the pairs with a changed face again, and
+// traces only the links with a ray through an edited box. Every bounce is
+// a pass over the links plus a push-pull over the patch trees.
+class HierarchicalRadiosity
+{
+public:
+    // Pairs with a form factor above this are split further
+    float epsilon = 0.02f;
+    // Pairs below this exchange too little light to link at all
+    float minFormFactor = 1e-5f;
+    // Share of the light reaching a face that it sends back out
+    float albedo = 0.5f;
+
+    size_t PatchCount() const { return patches.size(); }
+    size_t LinkCount() const { return transfers.size(); }
+
+    // Forgets every link, so the next Update refines every pair again
+    void Clear()
+    {
+        faces.clear();
+        wholeFaces.clear();
+        links.clear();
+        patches.clear();
+        transfers.clear();
+        roots.clear();
+        patchIndex.clear();
+    }
+
+    // Subdivides the faces and links every pair that sees each other.
+    // Visibility is tested against the occluder boxes with four rays per
+    // link between stratified points of the two patches. parallel(count,
+    // task) runs task(0) to task(count - 1), in any order and on any threads.
+    void Build(const std::vector<RadiosityFace>& newFaces, const CubeBVH& occluders,
+               const std::function<void(int, const std::function<void(int)>&)>& parallel)
+    {
+        Clear();
+        Update(newFaces, occluders, CubeBVH(), parallel);
+    }
+
+    // Brings the links up to date after an edit, dirty holding boxes around
+    // every occluder that changed since the last Build or Update. Pairs with
+    // a face that's new or changed are refined again; the rest keep their
+    // links, and only the links with a ray through a dirty box are traced
+    // again. Ends up with the same links in the same order as Build.
+    void Update(const std::vector<RadiosityFace>& newFaces, const CubeBVH& occluders, const CubeBVH& dirty,
+                const std::function<void(int, const std::function<void(int)>&)>& parallel)
+    {
+        BeginLinks(newFaces, occluders, dirty);
+        LinkFaces(0, (int)faces.size(), parallel);
+        EndLinks();
+        PatchFaces(0, (int)faces.size());
+    }
+
+    // Update in steps: BeginLinks, then LinkFaces or LinkPairs over every
+    // face in as many calls as suits, then EndLinks and PatchFaces. Solve
+    // can't run in between.
+    void BeginLinks(const std::vector<RadiosityFace>& newFaces, const CubeBVH& occluders, const CubeBVH& dirty)
+    {
+        changed.assign(newFaces.size(), true);
+        if (epsilon == linkedEpsilon && minFormFactor == linkedMinFormFactor) {
+            for (size_t f = 0; f < std::min(faces.size(), newFaces.size()); f++) {
+                changed[f] = !sameFace(faces[f], newFaces[f]);
+            }
+        }
+        faces = newFaces;
+        bvh = &occluders;
+        dirtyBoxes = dirty;
+        buildSources();
+        relinked.assign(faces.size(), std::vector<Link>());
+    }
+
+    // Links the receiving faces first to first + count - 1. Each only
+    // writes its own links, so they can all go at once and the result
+    // doesn't depend on the threads.
+    void LinkFaces(int first, int count,
+                   const std::function<void(int, const std::function<void(int)>&)>& parallel)
+    {
+        parallel(count, [&](int i) {
+            std::vector<int> sources;
+            SourcesOf(first + i, sources);
+            for (int source : sources) {
+                linkPair(first + i, source, relinked[first + i]);
+            }
+        });
+    }
+
+    // Every face the receiving face could get light from, in the order
+    // its links go in
+    void SourcesOf(int face, std::vector<int>& sources) const
+    {
+        sources.clear();
+        if (faces[face].width != 0) { sourcesFor(face, sources); }
+    }
+
+    // Links the receiving face with the next count of its sources, those
+    // pairs all at once, for when a face is too much for one go. Faces
+    // must be linked in order, each with all its sources in order.
+    void LinkPairs(int face, const int* sources, int count,
+                   const std::function<void(int, const std::function<void(int)>&)>& parallel)
+    {
+        std::vector<std::vector<Link>> pairs(count);
+        parallel(count, [&](int i) {
+            linkPair(face, sources[i], pairs[i]);
+        });
+        for (auto& pair : pairs) {
+            relinked[face].insert(relinked[face].end(), pair.begin(), pair.end());
+        }
+    }
+
+    void EndLinks()
+    {
+        links.swap(relinked);
+        relinked.clear();
+        changed.clear();
+        dirtyBoxes = CubeBVH();
+        linkedEpsilon = epsilon;
+        linkedMinFormFactor = minFormFactor;
+        patches.clear();
+        transfers.clear();
+        roots.assign(faces.size(), -1);
+        patchIndex.assign(faces.size(), std::unordered_map<uint64_t, int>());
+        for (int f = 0; f < (int)faces.size(); f++) {
+            if (faces[f].width == 0) { continue; }
+            patches.push_back(wholeFaces[f]);
+            roots[f] = (int)patches.size() - 1;
+            patchIndex[f][1] = roots[f];
+        }
+    }
+
+    // Lays out the patches the links of the receiving faces first to first
+    // + count - 1 need, and turns those of their links that get through
+    // into transfers. Goes after EndLinks, over every face in order, before
+    // Solve.
+    void PatchFaces(int first, int count)
+    {
+        for (int f = first; f < first + count; f++) {
+            for (const Link& l : links[f]) {
+                if (l.visible <= 0.0f) { continue; }
+                int receiver = patchAt(f, l.receiverKey);
+                int source = patchAt(l.sourceFace, l.sourceKey);
+                transfers.push_back(Transfer{receiver, source, l.formFactor * l.visible});
+            }
+        }
+        if (first + count == (int)faces.size()) {
+            patchIndex.clear();
+        }
+    }
+
+    int FaceCount() const { return (int)faces.size(); }
+
+    // Runs bounces gather and push-pull passes, starting from the direct
+    // light of every face's texels (row by row, width * height each).
+    // Fills indirect the same way with the light the bounces add.
+    void Solve(const std::vector<std::vector<float>>& direct, int bounces,
+               std::vector<std::vector<float>>& indirect)
+    {
+        for (int f = 0; f < (int)faces.size(); f++) {
+            SetDirect(f, direct[f]);
+        }
+        for (int bounce = 0; bounce < bounces; bounce++) {
+            Bounce();
+        }
+        indirect.assign(faces.size(), std::vector<float>());
+        for (int f = 0; f < (int)faces.size(); f++) {
+            if (roots[f] < 0) { continue; }
+            const RadiosityFace& face = faces[f];
+            indirect[f].resize((size_t)face.width * face.height);
+            for (int y = 0; y < face.height; y++) {
+                for (int x = 0; x < face.width; x++) {
+                    indirect[f][x + y * face.width] = Indirect(f, x, y);
+                }
+            }
+        }
+    }
+
+    // Solve in steps: SetDirect for every face, which may run on several
+    // faces at once, then one Bounce per bounce, then Indirect for the texels
+    void SetDirect(int face, const std::vector<float>& direct)
+    {
+        if (roots[face] >= 0) { averageDirect(roots[face], direct); }
+    }
+
+    void Bounce()
+    {
+        for (auto& p : patches) {
+            p.gathered = 0.0f;
+        }
+        for (auto& t : transfers) {
+            patches[t.receiver].gathered += t.formFactor * patches[t.source].radiosity;
+        }
+        for (int f = 0; f < (int)faces.size(); f++) {
+            if (roots[f] >= 0) { pushPull(roots[f], 0.0f); }
+        }
+    }
+
+    // Bounced light at a texel of a face with a chart
+    float Indirect(int face, int x, int y) const
+    {
+        const RadiosityFace& f = faces[face];
+        return patches[leafAt(roots[face], (x + 0.5f) / f.width, (y + 0.5f) / f.height)].indirect;
+    }
+
+private:
+    // A rectangle [s0,s1) x [t0,t1) of a face, in its texture coordinates.
+    // Its key is its place in the face's tree: 1 for the whole face, and
+    // 2k and 2k + 1 for the halves of patch k.
+    struct Patch {
+        int face;
+        uint64_t key;
+        float s0, s1, t0, t1;
+        int children[2];
+        float center[3];
+        float area;
+        // Direct light averaged over the patch, light gathered over its own
+        // links this bounce, the bounced light arriving through its own and
+        // its ancestors' links, and the total it sends out
+        float emitted, gathered, indirect, radiosity;
+    };
+
+    // Light arriving at the receiver from the source is formFactor *
+    // visible * source radiosity. Links are kept with their receiving face,
+    // in the order of their source faces. Blocked links are kept too, since
+    // an edit can open them up.
+    struct Link {
+        uint64_t receiverKey, sourceKey;
+        int sourceFace;
+        float formFactor, visible;
+    };
+
+    // A link that gets through, between patches of the trees
+    struct Transfer {
+        int receiver, source;
+        float formFactor;
+    };
+
+    // Bounding volume hierarchy over the centers of the faces pointing one
+    // way, as in CubeBVH, with the largest squared reach of the faces under
+    // each node
+    struct SourceNode {
+        float lo[3], hi[3];
+        float reach2;
+        int first, count;
+    };
+
+    static bool sameFace(const RadiosityFace& a, const RadiosityFace& b)
+    {
+        const CubeFace& fa = a.frame;
+        const CubeFace& fb = b.frame;
+        for (int axis = 0; axis < 3; axis++) {
+            if (fa.origin[axis] != fb.origin[axis] || fa.u[axis] != fb.u[axis] || fa.v[axis] != fb.v[axis]) {
+                return false;
+            }
+        }
+        return fa.axis == fb.axis && fa.sign == fb.sign && fa.plane == fb.plane &&
+               a.width == b.width && a.height == b.height && a.occluder == b.occluder;
+    }
+
+    Patch makePiece(int face, uint64_t key, float s0, float s1, float t0, float t1) const
+    {
+        const CubeFace& f = faces[face].frame;
+        Patch p;
+        p.face = face;
+        p.key = key;
+        p.s0 = s0; p.s1 = s1; p.t0 = t0; p.t1 = t1;
+        p.children[0] = p.children[1] = -1;
+        float s = (s0 + s1) * 0.5f, t = (t0 + t1) * 0.5f;
+        for (int axis = 0; axis < 3; axis++) {
+            p.center[axis] = f.origin[axis] + f.u[axis] * s + f.v[axis] * t;
+        }
+        p.area = length(f.u) * (s1 - s0) * length(f.v) * (t1 - t0);
+        p.emitted = p.gathered = p.indirect = p.radiosity = 0.0f;
+        return p;
+    }
+
+    static float length(const float* v)
+    {
+        return std::sqrt(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+    }
+
+    // Halves across the patch's longer side, as long as both halves keep at
+    // least a texel. Returns false if neither side can be split.
+    bool split(const Patch& p, Patch& a, Patch& b) const
+    {
+        const RadiosityFace& face = faces[p.face];
+        float sideS = length(face.frame.u) * (p.s1 - p.s0);
+        float sideT = length(face.frame.v) * (p.t1 - p.t0);
+        bool splitS = (p.s1 - p.s0) * face.width >= 2.0f;
+        bool splitT = (p.t1 - p.t0) * face.height >= 2.0f;
+        if (splitS && splitT) {
+            splitT = sideT > sideS;
+            splitS = !splitT;
+        }
+        if (!splitS && !splitT) { return false; }
+        if (splitS) {
+            float mid = (p.s0 + p.s1) * 0.5f;
+            a = makePiece(p.face, p.key * 2, p.s0, mid, p.t0, p.t1);
+            b = makePiece(p.face, p.key * 2 + 1, mid, p.s1, p.t0, p.t1);
+        } else {
+            float mid = (p.t0 + p.t1) * 0.5f;
+            a = makePiece(p.face, p.key * 2, p.s0, p.s1, p.t0, mid);
+            b = makePiece(p.face, p.key * 2 + 1, p.s0, p.s1, mid, p.t1);
+        }
+        return true;
+    }
+
+    // The patch at key in the face's tree, worked out from the whole face
+    Patch piece(int face, uint64_t key) const
+    {
+        Patch p = wholeFaces[face];
+        int depth = 0;
+        while ((key >> depth) > 1) { depth++; }
+        for (int bit = depth - 1; bit >= 0; bit--) {
+            Patch halves[2];
+            split(p, halves[0], halves[1]);
+            p = halves[(key >> bit) & 1];
+        }
+        return p;
+    }
+
+    // Unoccluded form factor from the receiver's center to the source, with
+    // the source as a disc of its area so near pairs don't blow up. Zero
+    // unless the two face each other.
+    float formFactor(const Patch& r, const Patch& s) const
+    {
+        const CubeFace& rf = faces[r.face].frame;
+        const CubeFace& sf = faces[s.face].frame;
+        float d[3] = {s.center[0] - r.center[0], s.center[1] - r.center[1], s.center[2] - r.center[2]};
+        float distance2 = d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        if (distance2 == 0.0f) { return 0.0f; }
+        float cosR = d[rf.axis] * rf.sign;
+        float cosS = -d[sf.axis] * sf.sign;
+        if (cosR <= 0.0f || cosS <= 0.0f) { return 0.0f; }
+        // cosR and cosS are each scaled by the distance
+        return cosR * cosS / distance2 * s.area / (3.14159265f * distance2 + s.area);
+    }
+
+    void refine(const Patch& receiver, const Patch& source, std::vector<Link>& out) const
+    {
+        float f = formFactor(receiver, source);
+        if (f < minFormFactor) { return; }
+        if (f > epsilon) {
+            // Split whichever is bigger, or the other if it's down to a texel
+            bool splitSource = source.area >= receiver.area;
+            Patch a, b;
+            bool splitted = split(splitSource ? source : receiver, a, b);
+            if (!splitted) {
+                splitSource = !splitSource;
+                splitted = split(splitSource ? source : receiver, a, b);
+            }
+            if (splitted) {
+                if (splitSource) {
+                    refine(receiver, a, out);
+                    refine(receiver, b, out);
+                } else {
+                    refine(a, source, out);
+                    refine(b, source, out);
+                }
+                return;
+            }
+        }
+        out.push_back(Link{receiver.key, source.key, source.face, f, visibility(receiver, source, *bvh)});
+    }
+
+    // The links of one receiving face with one source face: refined afresh
+    // if either changed, copied over from the last time otherwise
+    void linkPair(int face, int source, std::vector<Link>& out) const
+    {
+        if (face >= (int)links.size() || changed[face] || changed[source]) {
+            refine(wholeFaces[face], wholeFaces[source], out);
+            return;
+        }
+        const std::vector<Link>& kept = links[face];
+        auto first = std::lower_bound(kept.begin(), kept.end(), source,
+                                      [](const Link& l, int f) { return l.sourceFace < f; });
+        auto last = std::upper_bound(first, kept.end(), source,
+                                     [](int f, const Link& l) { return f < l.sourceFace; });
+        bool near = nearDirty(face, source);
+        for (auto it = first; it != last; ++it) {
+            Link l = *it;
+            if (near) {
+                Patch r = piece(face, l.receiverKey);
+                Patch s = piece(source, l.sourceKey);
+                if (visibility(r, s, dirtyBoxes) < 1.0f) {
+                    l.visible = visibility(r, s, *bvh);
+                }
+            }
+            out.push_back(l);
+        }
+    }
+
+    // Could a ray between the two faces pass through a dirty box: every
+    // ray stays inside the box around both faces' surface points
+    bool nearDirty(int a, int b) const
+    {
+        const CubeBVH& dirty = dirtyBoxes;
+        if (dirty.nodes.empty()) { return false; }
+        CubeBVH::Box both{
+            Float3{std::min(extents[a].lo.x, extents[b].lo.x), std::min(extents[a].lo.y, extents[b].lo.y), std::min(extents[a].lo.z, extents[b].lo.z)},
+            Float3{std::max(extents[a].hi.x, extents[b].hi.x), std::max(extents[a].hi.y, extents[b].hi.y), std::max(extents[a].hi.z, extents[b].hi.z)}
+        };
+        if (!overlaps(both, dirty.nodes[0].bounds)) { return false; }
+        for (auto& box : dirty.boxes) {
+            if (overlaps(both, box)) { return true; }
+        }
+        return false;
+    }
+
+    static bool overlaps(const CubeBVH::Box& a, const CubeBVH::Box& b)
+    {
+        return a.lo.x <= b.hi.x && b.lo.x <= a.hi.x &&
+               a.lo.y <= b.hi.y && b.lo.y <= a.hi.y &&
+               a.lo.z <= b.hi.z && b.lo.z <= a.hi.z;
+    }
+
+    // Whole-face patches, surface point boxes, reaches and the source trees
+    // for the current faces
+    void buildSources()
+    {
+        wholeFaces.clear();
+        extents.assign(faces.size(), CubeBVH::Box{});
+        reach2.assign(faces.size(), 0.0f);
+        sourceNodes.clear();
+        sourceFaces.clear();
+        // The form factor is at most area / (pi * distance^2 + area), so it
+        // drops under minFormFactor once distance^2 passes area * spread
+        float spread = minFormFactor > 0.0f ? (1.0f / minFormFactor - 1.0f) / 3.14159265f
+                                            : std::numeric_limits<float>::infinity();
+        for (int f = 0; f < (int)faces.size(); f++) {
+            wholeFaces.push_back(makePiece(f, 1, 0.0f, 1.0f, 0.0f, 1.0f));
+            if (faces[f].width == 0) { continue; }
+            float a[3], b[3];
+            surfacePoint(wholeFaces[f], 0.0f, 0.0f, a);
+            surfacePoint(wholeFaces[f], 1.0f, 1.0f, b);
+            extents[f] = CubeBVH::Box{Float3{std::min(a[0], b[0]), std::min(a[1], b[1]), std::min(a[2], b[2])},
+                                      Float3{std::max(a[0], b[0]), std::max(a[1], b[1]), std::max(a[2], b[2])}};
+            reach2[f] = wholeFaces[f].area * spread * 1.001f;
+        }
+        for (int side = 0; side < 6; side++) {
+            int first = (int)sourceFaces.size();
+            for (int f = 0; f < (int)faces.size(); f++) {
+                if (faces[f].width != 0 && faces[f].frame.axis * 2 + (faces[f].frame.sign > 0) == side) {
+                    sourceFaces.push_back(f);
+                }
+            }
+            int count = (int)sourceFaces.size() - first;
+            sourceRoots[side] = count > 0 ? buildSourceNode(first, count) : -1;
+        }
+    }
+
+    int buildSourceNode(int first, int count)
+    {
+        int index = (int)sourceNodes.size();
+        sourceNodes.push_back(SourceNode{});
+        SourceNode n;
+        n.reach2 = 0.0f;
+        for (int axis = 0; axis < 3; axis++) {
+            n.lo[axis] = n.hi[axis] = wholeFaces[sourceFaces[first]].center[axis];
+        }
+        for (int i = first; i < first + count; i++) {
+            const Patch& p = wholeFaces[sourceFaces[i]];
+            for (int axis = 0; axis < 3; axis++) {
+                n.lo[axis] = std::min(n.lo[axis], p.center[axis]);
+                n.hi[axis] = std::max(n.hi[axis], p.center[axis]);
+            }
+            n.reach2 = std::max(n.reach2, reach2[sourceFaces[i]]);
+        }
+        n.first = first;
+        n.count = count;
+        if (count > 4) {
+            // Median split along the longest axis of the centers
+            int a = 0;
+            for (int axis = 1; axis < 3; axis++) {
+                if (n.hi[axis] - n.lo[axis] > n.hi[a] - n.lo[a]) { a = axis; }
+            }
+            int mid = first + count / 2;
+            std::nth_element(sourceFaces.begin() + first, sourceFaces.begin() + mid, sourceFaces.begin() + first + count,
+                [&](int l, int r) { return wholeFaces[l].center[a] < wholeFaces[r].center[a]; });
+            buildSourceNode(first, mid - first);
+            n.first = buildSourceNode(mid, first + count - mid);
+            n.count = 0;
+        }
+        sourceNodes[index] = n;
+        return index;
+    }
+
+    // Every face whole-face form factor from the receiver reaches
+    // minFormFactor, in order. Skips trees and nodes whose centers are all
+    // behind the receiver, all facing away from it or all out of reach.
+    void sourcesFor(int receiver, std::vector<int>& out) const
+    {
+        const Patch& r = wholeFaces[receiver];
+        const CubeFace& rf = faces[receiver].frame;
+        for (int side = 0; side < 6; side++) {
+            if (sourceRoots[side] < 0) { continue; }
+            int axis = side / 2;
+            bool positive = side % 2 != 0;
+            int stack[64];
+            int top = 0;
+            stack[top++] = sourceRoots[side];
+            while (top > 0) {
+                int index = stack[--top];
+                const SourceNode& n = sourceNodes[index];
+                if (rf.sign > 0 ? n.hi[rf.axis] <= r.center[rf.axis] : n.lo[rf.axis] >= r.center[rf.axis]) { continue; }
+                if (positive ? n.lo[axis] >= r.center[axis] : n.hi[axis] <= r.center[axis]) { continue; }
+                float distance2 = 0.0f;
+                for (int a = 0; a < 3; a++) {
+                    float gap = std::max(0.0f, std::max(n.lo[a] - r.center[a], r.center[a] - n.hi[a]));
+                    distance2 += gap * gap;
+                }
+                if (distance2 > n.reach2) { continue; }
+                if (n.count > 0) {
+                    for (int i = n.first; i < n.first + n.count; i++) {
+                        int source = sourceFaces[i];
+                        if (source != receiver && formFactor(r, wholeFaces[source]) >= minFormFactor) {
+                            out.push_back(source);
+                        }
+                    }
+                } else {
+                    stack[top++] = n.first;
+                    stack[top++] = index + 1;
+                }
+            }
+        }
+        std::sort(out.begin(), out.end());
+    }
+
+    // Index of the patch at key, splitting its ancestors as needed
+    int patchAt(int face, uint64_t key)
+    {
+        std::unordered_map<uint64_t, int>& index = patchIndex[face];
+        auto found = index.find(key);
+        if (found != index.end()) { return found->second; }
+        int parent = patchAt(face, key >> 1);
+        Patch a, b;
+        split(patches[parent], a, b);
+        int first = (int)patches.size();
+        patches.push_back(a);
+        patches.push_back(b);
+        patches[parent].children[0] = first;
+        patches[parent].children[1] = first + 1;
+        index[a.key] = first;
+        index[b.key] = first + 1;
+        return key == a.key ? first : first + 1;
+    }
+
+    // A point of a patch, moved just off its face to the side it faces. An
+    // occluder's solid box reaches a cell past its + faces, so those points
+    // go that far out.
+    void surfacePoint(const Patch& p, float s, float t, float* out) const
+    {
+        const RadiosityFace& face = faces[p.face];
+        const CubeFace& f = face.frame;
+        float ps = p.s0 + (p.s1 - p.s0) * s, pt = p.t0 + (p.t1 - p.t0) * t;
+        for (int axis = 0; axis < 3; axis++) {
+            out[axis] = f.origin[axis] + f.u[axis] * ps + f.v[axis] * pt;
+        }
+        float offset = face.occluder && f.sign > 0 ? 1.0f : 0.0f;
+        out[f.axis] = f.plane + f.sign * 0.001f + offset;
+    }
+
+    // Share of four rays between stratified points of the two patches that
+    // get past the boxes
+    float visibility(const Patch& receiver, const Patch& source, const CubeBVH& boxes) const
+    {
+        const float spots[4][2] = {{0.25f, 0.25f}, {0.75f, 0.25f}, {0.25f, 0.75f}, {0.75f, 0.75f}};
+        // Paired up crosswise so the rays spread over both patches
+        const int pair[4] = {3, 2, 1, 0};
+        int clear = 0;
+        for (int i = 0; i < 4; i++) {
+            float a[3], b[3];
+            surfacePoint(receiver, spots[i][0], spots[i][1], a);
+            surfacePoint(source, spots[pair[i]][0], spots[pair[i]][1], b);
+            if (!boxes.AnyHit(Float3{a[0], a[1], a[2]}, Float3{b[0] - a[0], b[1] - a[1], b[2] - a[2]})) {
+                clear++;
+            }
+        }
+        return clear / 4.0f;
+    }
+
+    // Fills in emitted for a patch and everything under it from the texels
+    // whose centers it covers, and starts them off with no bounced light
+    void averageDirect(int index, const std::vector<float>& direct)
+    {
+        Patch& p = patches[index];
+        if (p.children[0] >= 0) {
+            int a = p.children[0], b = p.children[1];
+            averageDirect(a, direct);
+            averageDirect(b, direct);
+            const Patch& pa = patches[a];
+            const Patch& pb = patches[b];
+            patches[index].emitted = (pa.emitted * pa.area + pb.emitted * pb.area) / std::max(1e-12f, pa.area + pb.area);
+            patches[index].radiosity = patches[index].emitted;
+            patches[index].indirect = 0.0f;
+            return;
+        }
+        const RadiosityFace& face = faces[p.face];
+        int x0 = (int)std::ceil(p.s0 * face.width - 0.5f), x1 = (int)std::ceil(p.s1 * face.width - 0.5f);
+        int y0 = (int)std::ceil(p.t0 * face.height - 0.5f), y1 = (int)std::ceil(p.t1 * face.height - 0.5f);
+        double sum = 0.0;
+        int count = 0;
+        for (int y = std::max(0, y0); y < std::min(face.height, y1); y++) {
+            for (int x = std::max(0, x0); x < std::min(face.width, x1); x++) {
+                sum += direct[x + y * face.width];
+                count++;
+            }
+        }
+        p.emitted = count > 0 ? (float)(sum / count) : 0.0f;
+        p.radiosity = p.emitted;
+        p.indirect = 0.0f;
+    }
+
+    // Hands what each patch gathered down to its leaves, then sums the
+    // leaves back up into what every patch sends out next bounce
+    void pushPull(int index, float fromAbove)
+    {
+        Patch& p = patches[index];
+        float arriving = fromAbove + albedo * p.gathered;
+        if (p.children[0] < 0) {
+            p.indirect = arriving;
+            p.radiosity = p.emitted + p.indirect;
+            return;
+        }
+        int a = p.children[0], b = p.children[1];
+        pushPull(a, arriving);
+        pushPull(b, arriving);
+        const Patch& pa = patches[a];
+        const Patch& pb = patches[b];
+        float area = std::max(1e-12f, pa.area + pb.area);
+        patches[index].radiosity = (pa.radiosity * pa.area + pb.radiosity * pb.area) / area;
+        patches[index].indirect = (pa.indirect * pa.area + pb.indirect * pb.area) / area;
+    }
+
+    int leafAt(int index, float s, float t) const
+    {
+        while (patches[index].children[0] >= 0) {
+            const Patch& a = patches[patches[index].children[0]];
+            bool inA = s >= a.s0 && s < a.s1 && t >= a.t0 && t < a.t1;
+            index = patches[index].children[inA ? 0 : 1];
+        }
+        return index;
+    }
+
+    std::vector<RadiosityFace> faces;
+    const CubeBVH* bvh = nullptr;
+    // Settings the links were refined with
+    float linkedEpsilon = -1.0f;
+    float linkedMinFormFactor = -1.0f;
+    // Links of every receiving face
+    std::vector<std::vector<Link>> links;
+    // Between BeginLinks and EndLinks: which faces changed, the boxes edited
+    // since the last links, and the links made so far
+    std::vector<bool> changed;
+    CubeBVH dirtyBoxes;
+    std::vector<std::vector<Link>> relinked;
+    std::vector<Patch> patches;
+    std::vector<Transfer> transfers;
+    // Between EndLinks and the last PatchFaces: every face's patches by key
+    std::vector<std::unordered_map<uint64_t, int>> patchIndex;
+    // Top patch of every face, -1 for faces without a chart
+    std::vector<int> roots;
+    // The whole of every face, the box around its surface points and the
+    // squared distance its whole-face form factor stays in reach for
+    std::vector<Patch> wholeFaces;
+    std::vector<CubeBVH::Box> extents;
+    std::vector<float> reach2;
+    // Faces with a chart in a tree for each axis and side, leaves in order
+    std::vector<SourceNode> sourceNodes;
+    std::vector<int> sourceFaces;
+    int sourceRoots[6];
+};
+
+#endif
@@ -7,7 +7,10 @@ uniform sampler2D BaseTexture;
 uniform float TextureScaleVertical;
 uniform float TextureScaleHorizontal;
 uniform sampler2D LightMap;
-uniform int LightMapOffset;
+// Where this face's chart sits in the lightmap atlas: UV offset in xy, size in zw
+uniform vec4 LightMapRect;
+// Scale from the stored lightmap value back to light, for normalized formats
+uniform float LightMapRange;
 uniform bool Emissive;
 
 void main()
@@ -15,8 +18,9 @@ void main()
     if (Emissive) {
         FragColor = texture(BaseTexture, vec2(TexCoord.x*TextureScaleHorizontal,TexCoord.y*TextureScaleVertical));
     } else {
-        vec2 lmTex = vec2(TexCoord.x, TexCoord.y * ( (64.0/1024.0) * LightMapOffset) );
-        vec4 lm = vec4(texture(LightMap, lmTex).r,texture(LightMap, lmTex).r,texture(LightMap, lmTex).r,1.0);
+        vec2 lmTex = LightMapRect.xy + TexCoord * LightMapRect.zw;
+        float light = texture(LightMap, lmTex).r * LightMapRange;
+        vec4 lm = vec4(light,light,light,1.0);
         FragColor = texture(BaseTexture, vec2(TexCoord.x*TextureScaleHorizontal,TexCoord.y*TextureScaleVertical)) * lm;
     }
     //FragColor = texture(BaseTexture, TexCoord * TextureScale);
@@ -1,15 +1,28 @@
 #version 330 core
 layout (location = 0) in vec3 aPos;
 layout (location = 1) in vec2 aTexCoord;
+// The same, packed (see PackedLevelVertex): whole-cell positions, and
+// texture coordinates in fixed point with their fraction bits in aUVShift
+layout (location = 2) in ivec3 aPackedPos;
+layout (location = 3) in ivec2 aPackedTexCoord;
+layout (location = 4) in uint aUVShift;
 
 out vec2 TexCoord;
 
 uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
+uniform bool PackedVertices;
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(aPos, 1.0);
-    TexCoord = aTexCoord;
-}
\ No newline at end of file
+    vec3 pos = aPos;
+    vec2 texCoord = aTexCoord;
+    if (PackedVertices) {
+        pos = vec3(aPackedPos);
+        uvec2 shift = uvec2(aUVShift & 15u, (aUVShift >> 4) & 15u);
+        texCoord = vec2(aPackedTexCoord) / vec2(uvec2(1u) << shift);
+    }
+    gl_Position = projection * view * model * vec4(pos, 1.0);
+    TexCoord = texCoord;
+}
@@ -0,0 +1,66 @@
+#ifndef SPSCQUEUE_H
+#define SPSCQUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Fixed size ring buffer for handing items from exactly one producer thread
+// to exactly one consumer thread without locks. Each side only writes its
+// own index; the release store on it publishes the slot it just filled or
+// emptied to the other side.
+template <typename T>
+class SpscQueue
+{
+public:
+    // Holds up to capacity items at once
+    explicit SpscQueue(size_t capacity) : slots(capacity + 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    // Producer only. Leaves item alone and returns false when full.
+    bool TryPush(T& item)
+    {
+        size_t tail = tailIndex.load(std::memory_order_relaxed);
+        size_t next = advance(tail);
+        if (next == headIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        slots[tail] = std::move(item);
+        tailIndex.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false when empty.
+    bool TryPop(T& item)
+    {
+        size_t head = headIndex.load(std::memory_order_relaxed);
+        if (head == tailIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(slots[head]);
+        headIndex.store(advance(head), std::memory_order_release);
+        return true;
+    }
+
+    // Either side, a snapshot that may be stale by the time it's used
+    bool Empty() const
+    {
+        return headIndex.load(std::memory_order_acquire) == tailIndex.load(std::memory_order_acquire);
+    }
+
+private:
+    size_t advance(size_t index) const
+    {
+        return index + 1 == slots.size() ? 0 : index + 1;
+    }
+
+    std::vector<T> slots;
+    // Kept on separate cache lines so the two threads don't fight over one
+    alignas(64) std::atomic<size_t> headIndex{0};
+    alignas(64) std::atomic<size_t> tailIndex{0};
+};
+
+#endif
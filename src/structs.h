@@ -1,4 +1,9 @@
+#ifndef STRUCTS_H
+#define STRUCTS_H
+
 #include <cstdint>
+#include <string>
+#include <algorithm>
 
 #define FACE_TOP    0b00000001
 #define FACE_BOTTOM 0b00000010
@@ -14,6 +19,14 @@ struct Int3 {
 
 typedef struct Int3 Int3;
 
+inline Int3 MinInt3(Int3 a, Int3 b) {
+    return Int3{std::min(a.x,b.x),std::min(a.y,b.y),std::min(a.z,b.z)};
+}
+
+inline Int3 MaxInt3(Int3 a, Int3 b) {
+    return Int3{std::max(a.x,b.x),std::max(a.y,b.y),std::max(a.z,b.z)};
+}
+
 struct Float3 {
     float x,y,z;
 };
@@ -37,13 +50,28 @@ struct Cube {
     float textureScaleVertical = 1.0;
     // References biggest dimension
     int lightMapScale = 64;
+    // FACE_* flags of the faces that are drawn and get a lightmap
+    uint8_t faces = FACE_TOP | FACE_BOTTOM | FACE_NORTH | FACE_SOUTH | FACE_EAST | FACE_WEST;
 };
 
 typedef struct Cube Cube;
 
+// Part of a light that gives off light. Area lights lie flat in the XZ
+// plane around the middle of their pos cell.
+enum LightShape {
+    LIGHT_POINT,
+    LIGHT_DISC, // sizeX is the radius
+    LIGHT_RECT  // sizeX and sizeZ are half the extent along x and z
+};
+
 struct PointLight {
     Int3 pos;
     float falloff = 0.01;
+    LightShape shape = LIGHT_POINT;
+    float sizeX = 0.0f;
+    float sizeZ = 0.0f;
 };
 
-typedef struct PointLight PointLight;
\ No newline at end of file
+typedef struct PointLight PointLight;
+
+#endif
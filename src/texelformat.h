@@ -0,0 +1,231 @@
+#ifndef TEXELFORMAT_H
+#define TEXELFORMAT_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+#include "packet.h"
+
+// Storage formats for the baked lightmap. The baker always works in floats;
+// these are what gets uploaded and sits in VRAM.
+enum LightMapFormat {
+    LIGHTMAP_FLOAT,  // 32-bit float, 4 bytes
+    LIGHTMAP_R8,     // unsigned normalized over [0, range], 1 byte
+    LIGHTMAP_R16F,   // half float, 2 bytes
+    LIGHTMAP_RGB9E5  // shared exponent RGB, 4 bytes, gray until lights have color
+};
+
+inline int TexelFormatBytes(LightMapFormat format)
+{
+    switch (format) {
+        case LIGHTMAP_R8:
+            return 1;
+        case LIGHTMAP_R16F:
+            return 2;
+        case LIGHTMAP_RGB9E5:
+        case LIGHTMAP_FLOAT:
+        default:
+            return 4;
+    }
+}
+
+inline uint32_t FloatBits(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+inline float BitsFloat(uint32_t bits)
+{
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Round to nearest even, same as the F16C instructions for everything but NaN payloads
+inline uint16_t FloatToHalf(float value)
+{
+    const uint32_t f16Max = (127 + 16) << 23;
+    const uint32_t denormMagic = ((127 - 15) + (23 - 10) + 1) << 23;
+    uint32_t f = FloatBits(value);
+    uint32_t sign = f & 0x80000000u;
+    f ^= sign;
+
+    uint16_t half;
+    if (f >= f16Max) {
+        // Too big is infinity, NaN stays NaN
+        half = f > 0x7f800000u ? 0x7e00 : 0x7c00;
+    } else if (f < (113u << 23)) {
+        // Below the smallest normal half: let float addition do the rounding
+        half = (uint16_t)(FloatBits(BitsFloat(f) + BitsFloat(denormMagic)) - denormMagic);
+    } else {
+        uint32_t mantissaOdd = (f >> 13) & 1;
+        f += ((uint32_t)(15 - 127) << 23) + 0xfff;
+        f += mantissaOdd;
+        half = (uint16_t)(f >> 13);
+    }
+    return half | (uint16_t)(sign >> 16);
+}
+
+// Clamped to [0,1] first so NaN comes out as 0, like the SSE min/max do
+inline uint8_t FloatToUnorm8(float value, float scale)
+{
+    float v = value * scale;
+    v = v > 0.0f ? v : 0.0f;
+    v = v < 1.0f ? v : 1.0f;
+    return (uint8_t)(int)(v * 255.0f + 0.5f);
+}
+
+// Gray RGB9E5 as laid out by GL_UNSIGNED_INT_5_9_9_9_REV, following the
+// encoding in EXT_texture_shared_exponent: 9 bit mantissas, exponent bias 15
+inline uint32_t FloatToRGB9E5(float value)
+{
+    const float maxValue = 511.0f / 512.0f * 65536.0f;
+    float v = value > 0.0f ? value : 0.0f;
+    v = v < maxValue ? v : maxValue;
+
+    // Zero and denormals have an exponent field of 0 and land on the
+    // smallest shared exponent
+    int floorLog2 = (int)((FloatBits(v) >> 23) & 0xff) - 127;
+    int exponent = std::max(-16, floorLog2) + 16;
+    // Scaling by 2^(24 - exponent) puts the value in mantissa units
+    float scale = BitsFloat((uint32_t)(24 - exponent + 127) << 23);
+    if ((int)(v * scale + 0.5f) == 512) {
+        exponent++;
+        scale *= 0.5f;
+    }
+    uint32_t m = (uint32_t)(int)(v * scale + 0.5f);
+    return m | m << 9 | m << 18 | (uint32_t)exponent << 27;
+}
+
+inline void ConvertTexelsScalar(const float* src, size_t count, LightMapFormat format, float range, void* dst)
+{
+    switch (format) {
+        case LIGHTMAP_R8: {
+            uint8_t* out = (uint8_t*)dst;
+            float scale = 1.0f / range;
+            for (size_t i = 0; i < count; i++) {
+                out[i] = FloatToUnorm8(src[i], scale);
+            }
+            break;
+        }
+        case LIGHTMAP_R16F: {
+            uint16_t* out = (uint16_t*)dst;
+            for (size_t i = 0; i < count; i++) {
+                out[i] = FloatToHalf(src[i]);
+            }
+            break;
+        }
+        case LIGHTMAP_RGB9E5: {
+            uint32_t* out = (uint32_t*)dst;
+            for (size_t i = 0; i < count; i++) {
+                out[i] = FloatToRGB9E5(src[i]);
+            }
+            break;
+        }
+        case LIGHTMAP_FLOAT:
+        default:
+            memcpy(dst, src, count * sizeof(float));
+            break;
+    }
+}
+
+#ifdef PACKET_X86
+
+// 16 texels per round: four float vectors narrowed to one vector of bytes
+__attribute__((target("sse2")))
+inline size_t ConvertUnorm8SSE2(const float* src, size_t count, float range, uint8_t* out)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / range);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 max = _mm_set1_ps(255.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i q[4];
+        for (int k = 0; k < 4; k++) {
+            __m128 v = _mm_mul_ps(_mm_loadu_ps(src + i + 4*k), scale);
+            v = _mm_min_ps(_mm_max_ps(v, zero), one);
+            q[k] = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, max), half));
+        }
+        __m128i words = _mm_packs_epi32(q[0], q[1]);
+        __m128i words2 = _mm_packs_epi32(q[2], q[3]);
+        _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(words, words2));
+    }
+    return i;
+}
+
+// Same steps as FloatToRGB9E5, four texels at a time
+__attribute__((target("sse2")))
+inline size_t ConvertRGB9E5SSE2(const float* src, size_t count, uint32_t* out)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxValue = _mm_set1_ps(511.0f / 512.0f * 65536.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128i minLog2 = _mm_set1_epi32(-16);
+    const __m128i exponentMask = _mm_set1_epi32(0xff);
+    const __m128i full = _mm_set1_epi32(512);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), zero), maxValue);
+        __m128i floorLog2 = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(_mm_castps_si128(v), 23), exponentMask), _mm_set1_epi32(127));
+        __m128i low = _mm_cmplt_epi32(floorLog2, minLog2);
+        floorLog2 = _mm_or_si128(_mm_and_si128(low, minLog2), _mm_andnot_si128(low, floorLog2));
+        __m128i exponent = _mm_add_epi32(floorLog2, _mm_set1_epi32(16));
+        __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_sub_epi32(_mm_set1_epi32(24 + 127), exponent), 23));
+        __m128i overflow = _mm_cmpeq_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), half)), full);
+        exponent = _mm_sub_epi32(exponent, overflow);
+        scale = _mm_castsi128_ps(_mm_add_epi32(_mm_castps_si128(scale), _mm_and_si128(overflow, _mm_set1_epi32(-(1 << 23)))));
+        __m128i m = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, scale), half));
+        __m128i packed = _mm_or_si128(_mm_or_si128(m, _mm_slli_epi32(m, 9)),
+            _mm_or_si128(_mm_slli_epi32(m, 18), _mm_slli_epi32(exponent, 27)));
+        _mm_storeu_si128((__m128i*)(out + i), packed);
+    }
+    return i;
+}
+
+__attribute__((target("avx,f16c")))
+inline size_t ConvertHalfF16C(const float* src, size_t count, uint16_t* out)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i h = _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i*)(out + i), h);
+    }
+    return i;
+}
+
+inline bool HasF16C()
+{
+    static const bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+#endif
+
+// Converts count floats into format at dst. The SIMD paths handle the bulk
+// and leave the tail to the scalar code, which rounds the same way, so the
+// output doesn't depend on the SIMD level.
+inline void ConvertTexels(const float* src, size_t count, LightMapFormat format, float range, void* dst, SimdLevel level)
+{
+    size_t done = 0;
+#ifdef PACKET_X86
+    if (format == LIGHTMAP_R8 && level >= SIMD_SSE2) {
+        done = ConvertUnorm8SSE2(src, count, range, (uint8_t*)dst);
+    }
+    if (format == LIGHTMAP_R16F && level >= SIMD_AVX2 && HasF16C()) {
+        done = ConvertHalfF16C(src, count, (uint16_t*)dst);
+    }
+    if (format == LIGHTMAP_RGB9E5 && level >= SIMD_SSE2) {
+        done = ConvertRGB9E5SSE2(src, count, (uint32_t*)dst);
+    }
+#endif
+    ConvertTexelsScalar(src + done, count - done, format, range,
+        (uint8_t*)dst + done * TexelFormatBytes(format));
+}
+
+#endif
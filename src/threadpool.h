@@ -0,0 +1,142 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads with one task queue each. A worker takes
+// tasks from the back of its own queue and, once that runs dry, steals from
+// the front of the others, so a worker that drew cheap tasks helps out the
+// ones that drew expensive ones.
+class ThreadPool
+{
+public:
+    // 0 workers means one per hardware thread
+    explicit ThreadPool(unsigned int workerCount = 0)
+    {
+        if (workerCount == 0) {
+            workerCount = std::max(1u, std::thread::hardware_concurrency());
+        }
+        for (unsigned int i = 0; i < workerCount; i++) {
+            queues.push_back(std::unique_ptr<Queue>(new Queue()));
+        }
+        for (unsigned int i = 0; i < workerCount; i++) {
+            workers.emplace_back([this, i]() { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            stopping = true;
+        }
+        jobStarted.notify_all();
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
+
+    unsigned int WorkerCount() const
+    {
+        return (unsigned int)workers.size();
+    }
+
+    // Runs task(i) for every i in [0, count) across the workers and returns
+    // once all of them are done. Tasks are dealt out round robin up front.
+    // Only one thread may call this at a time.
+    void ParallelFor(int count, const std::function<void(int)>& task)
+    {
+        if (count <= 0) { return; }
+        {
+            std::lock_guard<std::mutex> lock(jobMutex);
+            remaining = count;
+        }
+        for (int i = 0; i < count; i++) {
+            Queue& q = *queues[i % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            q.items.push_back(Item{&task, i});
+        }
+
+        std::unique_lock<std::mutex> lock(jobMutex);
+        generation++;
+        jobStarted.notify_all();
+        jobDone.wait(lock, [this]() { return remaining == 0; });
+    }
+
+private:
+    // Items carry their task, so a worker still draining the previous job
+    // can't run a new item with a stale function
+    struct Item {
+        const std::function<void(int)>* task;
+        int index;
+    };
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex jobMutex;
+    std::condition_variable jobStarted;
+    std::condition_variable jobDone;
+    int remaining = 0;
+    unsigned long generation = 0;
+    bool stopping = false;
+
+    bool popOwn(unsigned int self, Item& item)
+    {
+        Queue& q = *queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        if (q.items.empty()) { return false; }
+        item = q.items.back();
+        q.items.pop_back();
+        return true;
+    }
+
+    bool steal(unsigned int self, Item& item)
+    {
+        for (size_t n = 1; n < queues.size(); n++) {
+            Queue& q = *queues[(self + n) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (q.items.empty()) { continue; }
+            item = q.items.front();
+            q.items.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned int self)
+    {
+        unsigned long seen = 0;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(jobMutex);
+                jobStarted.wait(lock, [&]() { return stopping || generation != seen; });
+                if (stopping) { return; }
+                seen = generation;
+            }
+
+            Item item;
+            while (popOwn(self, item) || steal(self, item)) {
+                (*item.task)(item.index);
+                std::lock_guard<std::mutex> lock(jobMutex);
+                if (--remaining == 0) {
+                    jobDone.notify_one();
+                }
+            }
+        }
+    }
+};
+
+#endif
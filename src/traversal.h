@@ -0,0 +1,91 @@
+#ifndef TRAVERSAL_H
+#define TRAVERSAL_H
+
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+
+// State of one Amanatides-Woo walk over a 2D grid of unit cells
+struct CellWalk2D {
+    int cellX, cellY;
+    int stepX, stepY;
+    // Cell borders left to cross on each axis
+    int remainingX, remainingY;
+    float tMaxX, tMaxY;
+    float tDeltaX, tDeltaY;
+};
+
+typedef struct CellWalk2D CellWalk2D;
+
+// Sets up a walk along the half-open segment origin + t*(dx,dy), t in [0,1).
+// Shared by the scalar and packet kernels so both make the same decisions.
+inline CellWalk2D BeginCellWalk2D(float originX, float originY, float dx, float dy)
+{
+    const float inf = std::numeric_limits<float>::infinity();
+    CellWalk2D w;
+
+    w.cellX = (int)std::floor(originX);
+    w.cellY = (int)std::floor(originY);
+
+    w.stepX = (dx > 0.0f) - (dx < 0.0f);
+    w.stepY = (dy > 0.0f) - (dy < 0.0f);
+
+    // Last cell is the one just before the end point, so an end point lying
+    // on a cell border doesn't pull in the cell behind it
+    float endX = originX + dx;
+    float endY = originY + dy;
+    int lastX = w.stepX > 0 ? (int)std::ceil(endX) - 1 : (w.stepX < 0 ? (int)std::floor(endX) : w.cellX);
+    int lastY = w.stepY > 0 ? (int)std::ceil(endY) - 1 : (w.stepY < 0 ? (int)std::floor(endY) : w.cellY);
+    // Rounding can put the end a cell behind the start on very short segments
+    if ((lastX - w.cellX) * w.stepX < 0) { lastX = w.cellX; }
+    if ((lastY - w.cellY) * w.stepY < 0) { lastY = w.cellY; }
+
+    w.tDeltaX = w.stepX != 0 ? std::abs(1.0f / dx) : inf;
+    w.tDeltaY = w.stepY != 0 ? std::abs(1.0f / dy) : inf;
+    w.tMaxX = w.stepX > 0 ? (w.cellX + 1 - originX) / dx : (w.stepX < 0 ? (w.cellX - originX) / dx : inf);
+    w.tMaxY = w.stepY > 0 ? (w.cellY + 1 - originY) / dy : (w.stepY < 0 ? (w.cellY - originY) / dy : inf);
+
+    // Counting the crossings up front keeps float drift in tMax from ever
+    // adding or dropping a cell
+    w.remainingX = std::abs(lastX - w.cellX);
+    w.remainingY = std::abs(lastY - w.cellY);
+    return w;
+}
+
+// Moves a walk into the next cell. Written without a branch: which axis
+// comes next is close to random, and a mispredict per cell costs more than
+// the cell test itself.
+inline void StepCellWalk2D(CellWalk2D& w)
+{
+    bool alongX = w.remainingY == 0 || (w.remainingX > 0 && w.tMaxX < w.tMaxY);
+    w.cellX += alongX ? w.stepX : 0;
+    w.cellY += alongX ? 0 : w.stepY;
+    w.tMaxX += alongX ? w.tDeltaX : 0.0f;
+    w.tMaxY += alongX ? 0.0f : w.tDeltaY;
+    w.remainingX -= alongX;
+    w.remainingY -= !alongX;
+}
+
+// Amanatides-Woo voxel traversal on a 2D grid of unit cells.
+// Calls visit(cellX, cellY) for every cell the half-open segment
+// origin + t*(dx,dy), t in [0,1), passes through, in order, each exactly
+// once. When the segment goes exactly through a grid corner one of the two
+// side cells is visited as well, so a blocker is never skipped.
+// Returns true as soon as visit does, false if the whole segment was walked.
+template<typename Visit>
+bool TraverseCells2D(float originX, float originY, float dx, float dy, Visit visit)
+{
+    CellWalk2D w = BeginCellWalk2D(originX, originY, dx, dy);
+    for (;;) {
+        if (visit(w.cellX, w.cellY)) {
+            return true;
+        }
+        if (w.remainingX + w.remainingY == 0) {
+            break;
+        }
+        StepCellWalk2D(w);
+    }
+    return false;
+}
+
+#endif
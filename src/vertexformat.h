@@ -0,0 +1,79 @@
+#ifndef VERTEXFORMAT_H
+#define VERTEXFORMAT_H
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "structs.h"
+
+// Layouts level mesh vertices are uploaded in. Meshes are always built as
+// floats (x, y, z, u, v); these are what sits in the vertex buffer.
+enum LevelVertexFormat {
+    LEVEL_VERTEX_FLOAT,  // 5 floats, 20 bytes
+    LEVEL_VERTEX_PACKED  // PackedLevelVertex, 12 bytes
+};
+
+// Positions are whole cells, so 16-bit integers hold them exactly.
+// Texture coordinates are 16-bit fixed point, each with as many fraction
+// bits as its size leaves room for: uvShift holds the count for u in the
+// low 4 bits and for v in the next 4. Lightmap coordinates, never past 1,
+// keep 14 bits of fraction; emissive ones that carry on over a merged
+// quad keep fewer the further they run.
+struct PackedLevelVertex {
+    int16_t pos[3];
+    int16_t uv[2];
+    uint16_t uvShift;
+};
+
+typedef struct PackedLevelVertex PackedLevelVertex;
+
+inline int LevelVertexBytes(LevelVertexFormat format)
+{
+    return format == LEVEL_VERTEX_PACKED ? (int)sizeof(PackedLevelVertex) : 5 * (int)sizeof(float);
+}
+
+// Can every vertex of the level be packed: each corner within 16 bits, and
+// the level no wider than that either, since that bounds how far texture
+// coordinates run from where they start
+inline bool LevelFitsPackedVertices(const std::vector<Cube>& cubes)
+{
+    if (cubes.empty()) { return true; }
+    Int3 lo = MinInt3(cubes[0].cornerA, cubes[0].cornerB);
+    Int3 hi = MaxInt3(cubes[0].cornerA, cubes[0].cornerB);
+    for (const Cube& c : cubes) {
+        lo = MinInt3(lo, MinInt3(c.cornerA, c.cornerB));
+        hi = MaxInt3(hi, MaxInt3(c.cornerA, c.cornerB));
+    }
+    const int lowest = INT16_MIN, highest = INT16_MAX;
+    return lo.x >= lowest && lo.y >= lowest && lo.z >= lowest &&
+           hi.x <= highest && hi.y <= highest && hi.z <= highest &&
+           hi.x - lo.x <= highest && hi.y - lo.y <= highest && hi.z - lo.z <= highest;
+}
+
+// Most fraction bits value can keep and still fit in an int16
+inline int PackedFractionBits(float value)
+{
+    int shift = 15;
+    while (shift > 0 && std::fabs(value) * (float)(1 << shift) > (float)INT16_MAX) {
+        shift--;
+    }
+    return shift;
+}
+
+inline PackedLevelVertex PackLevelVertex(const float* vertex)
+{
+    PackedLevelVertex p;
+    for (int axis = 0; axis < 3; axis++) {
+        p.pos[axis] = (int16_t)std::lround(vertex[axis]);
+    }
+    int shiftU = PackedFractionBits(vertex[3]);
+    int shiftV = PackedFractionBits(vertex[4]);
+    p.uv[0] = (int16_t)std::lround(vertex[3] * (float)(1 << shiftU));
+    p.uv[1] = (int16_t)std::lround(vertex[4] * (float)(1 << shiftV));
+    p.uvShift = (uint16_t)(shiftU | (shiftV << 4));
+    return p;
+}
+
+#endif